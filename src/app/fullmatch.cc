@@ -19,9 +19,10 @@ int main(int argc, char *argv[]) {
   std::size_t thread_num = 1;
   std::size_t count = 1;
   bool print = false;
+  bool lazy = false, speculative = false;
   Regen::Options::CompileFlag olevel = Regen::Options::Onone;
 
-  while ((opt = getopt(argc, argv, "pc:f:O:t:")) != -1) {
+  while ((opt = getopt(argc, argv, "plsc:f:O:t:")) != -1) {
     switch(opt) {
       case 'c': {
         count = atoi(optarg);
@@ -44,6 +45,14 @@ int main(int argc, char *argv[]) {
         print = true;
         break;
       }
+      case 'l': {
+        lazy = true;
+        break;
+      }
+      case 's': {
+        speculative = true;
+        break;
+      }
     }
   }
   
@@ -78,15 +87,16 @@ int main(int argc, char *argv[]) {
     } else {
 #ifdef REGEN_ENABLE_PARALLEL
       compile_time -= rdtsc();
-      regen::Regex r = regen::Regex(regex);
+      regen::Regex r = regen::Regex(regex, opt);
       r.Compile(Regen::Options::O0);
-      regen::SFA sfa(r.dfa(), thread_num);
+      regen::SFA sfa(r.dfa(), thread_num, lazy ? regen::SFA::Lazy : speculative ? regen::SFA::Speculative : regen::SFA::Eager);
       sfa.Compile(olevel);
       compile_time += rdtsc();
-      Regen::StringPiece string(mm.ptr, mm.size);
+      Regen::StringPiece string(mm.ptr, mm.size), result(string);
       matching_time -= rdtsc();
-      match = sfa.Match(string);
+      match = sfa.Match(string, print ? &result : NULL);
       matching_time += rdtsc();
+      if (print && match) printf("%.*s\n", (int)(result.end() - string.begin()), string.data());
 #else
       exitmsg("SFA is not supported.\n");
 #endif
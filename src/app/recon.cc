@@ -145,6 +145,7 @@ void die(bool help = false)
            "Output control:\n"
            "  -t   generate acceptable strings\n"
            "  -d   generate DFA graph (Dot language)\n"
+           "  -c   generate C code of DFA (int match(begin, end, &matchend))\n"
            "  -s   generate SFA graph (Dot language)\n"
            "  -k   extract keywords"
            "  -m   minimizing DFA\n"
@@ -273,6 +274,7 @@ int main(int argc, char *argv[]) {
 #ifdef REGEN_ENABLE_PARALLEL
     if (sfa) {
       regen::SFA s(r.dfa());
+      if (minimize) s.Minimize();
       Dispatch(generate, s);
     } else
 #endif //REGEN_ENABLE_PARALLEL
@@ -95,7 +95,10 @@ void grep(const Regen &re, const regen::Util::mmap_t &buf, const Option &opt)
 {
   Regen::StringPiece string(buf.ptr, buf.size), result;
   static const char newline[] = "\n";
-  int count = 0;
+  if (opt.count_line) {
+    printf("%" PRIuS "\n", re.Count(string));
+    return;
+  }
   while (re.Match(string, &result)) {
     if (opt.only_matching) {
       if (result.begin() == result.end()) {
@@ -108,16 +111,11 @@ void grep(const Regen &re, const regen::Util::mmap_t &buf, const Option &opt)
     } else {
       const char *end = (const char*)memchr(result.end(), '\n', string.end()-result.end());
       if (end == NULL) end = string.end();
-      if (opt.count_line) {
-        count++;
-      } else {
-        const char *beg = get_line_beg(result.end(), string.begin());
-        if (*beg == '\n') beg++;
-        write(1, beg, end-beg+1);
-      }
+      const char *beg = get_line_beg(result.end(), string.begin());
+      if (*beg == '\n') beg++;
+      write(1, beg, end-beg+1);
       string.set_begin(end+1);
     }
     if (string.empty()) break;
   }
-  if (opt.count_line) printf("%d\n", count);
 }
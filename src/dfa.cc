@@ -1,21 +1,34 @@
 #include "dfa.h"
+#ifdef REGEN_ENABLE_JIT
+#include "ext/xbyak/xbyak_util.h"
+#endif
+#ifdef REGEN_ENABLE_PARALLEL
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#endif
 
 namespace regen {
 
 DFA::DFA(const ExprInfo &expr_info, std::size_t limit):
-    expr_info_(expr_info), complete_(false), minimum_(false), olevel_(Regen::Options::O0)
+    expr_info_(expr_info), complete_(false), minimum_(false), olevel_(Regen::Options::O0),
+    cache_generation_(0), cache_budget_(0), cache_flushes_(0), nfa_fallbacks_(0),
+    match_table_(NULL), match_accept_(NULL), match_eol_(NULL), match_stride_(NULL), table_width_(4), image_(NULL)
 #ifdef REGEN_ENABLE_JIT
-    , xgen_(NULL)
+    , xgen_(NULL), xcount_(NULL), jitter_(NULL), code_(NULL), code_size_(0)
 #endif
+    , som_generation_(0)
 {
   complete_ = Construct(limit);
 }
 
 DFA::DFA(const NFA &nfa, std::size_t limit):
-    complete_(false), minimum_(false), olevel_(Regen::Options::O0)
+    complete_(false), minimum_(false), olevel_(Regen::Options::O0),
+    cache_generation_(0), cache_budget_(0), cache_flushes_(0), nfa_fallbacks_(0),
+    match_table_(NULL), match_accept_(NULL), match_eol_(NULL), match_stride_(NULL), table_width_(4), image_(NULL)
 #ifdef REGEN_ENABLE_JIT
-    , xgen_(NULL)
+    , xgen_(NULL), xcount_(NULL), jitter_(NULL), code_(NULL), code_size_(0)
 #endif
+    , som_generation_(0)
 {
   complete_ = Construct(nfa, limit);
 }
@@ -112,38 +125,189 @@ void DFA::FillTransition(StateExpr* state, std::vector<Subset>* transition) cons
       Literal *lit = static_cast<Literal*>(state);
       unsigned char index = lit->literal();
       if (index == flag_.delimiter() && !flag_.one_line()) break;
-      (*transition)[index].insert(lit->follow().begin(), lit->follow().end());
+      (*transition)[alphabet_[index]].insert(lit->follow().begin(), lit->follow().end());
       break;
     }
     case Expr::kCharClass: {
       CharClass *cc = static_cast<CharClass*>(state);
-      for (std::size_t c = 0; c < 256; c++) {
+      for (std::size_t k = 0; k < alphabet_.size; k++) {
+        unsigned char c = alphabet_.rep[k];
         if (c == flag_.delimiter() && !flag_.one_line()) continue;
         if (cc->Match(c)) {
-          (*transition)[c].insert(cc->follow().begin(), cc->follow().end());
+          (*transition)[k].insert(cc->follow().begin(), cc->follow().end());
         }
       }
       break;
     }
     case Expr::kDot: {
       Dot *dot = static_cast<Dot*>(state);
-      for (std::size_t c = 0; c < 256; c++) {
+      for (std::size_t k = 0; k < alphabet_.size; k++) {
+        unsigned char c = alphabet_.rep[k];
         if (c == flag_.delimiter() && !flag_.one_line()
             && !dot->match_delimiter()) continue;
-        (*transition)[c].insert(dot->follow().begin(), dot->follow().end());
+        (*transition)[k].insert(dot->follow().begin(), dot->follow().end());
       }
       break;
     }
     case Expr::kAnchor:
       if (!flag_.one_line()) {
       Anchor* an = static_cast<Anchor*>(state);
-      (*transition)[flag_.delimiter()].insert(an->follow().begin(), an->follow().end());
+      (*transition)[alphabet_[flag_.delimiter()]].insert(an->follow().begin(), an->follow().end());
       }
       break;
     default: break;
   }
 }
 
+void DFA::Alphabet::Split(const std::bitset<256> &set)
+{
+  std::vector<std::size_t> in(size), total(size);
+  std::vector<int> split(size, -1);
+  for (std::size_t c = 0; c < 256; c++) {
+    total[map[c]]++;
+    if (set[c]) in[map[c]]++;
+  }
+  for (std::size_t c = 0; c < 256; c++) {
+    std::size_t k = map[c];
+    if (!set[c] || in[k] == total[k]) continue;
+    if (split[k] < 0) split[k] = size++;
+    map[c] = split[k];
+  }
+}
+
+void DFA::Alphabet::Normalize()
+{
+  // renumber classes by their smallest byte.
+  int renum[256];
+  std::fill(renum, renum+256, -1);
+  size = 0;
+  for (std::size_t c = 0; c < 256; c++) {
+    if (renum[map[c]] < 0) {
+      renum[map[c]] = size;
+      rep[size++] = c;
+    }
+    map[c] = renum[map[c]];
+  }
+}
+
+std::size_t DFA::SubsetTable::Hash(const Subset &subset)
+{
+  std::size_t hash = subset.size();
+  for (Subset::const_iterator iter = subset.begin(); iter != subset.end(); ++iter) {
+    hash ^= reinterpret_cast<std::size_t>(*iter) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+  }
+  return hash;
+}
+
+bool DFA::SubsetTable::Equal(const Entry &entry, const Subset &subset) const
+{
+  if (entry.end - entry.begin != subset.size()) return false;
+  return std::equal(subset.begin(), subset.end(), positions_.begin()+entry.begin);
+}
+
+DFA::state_t DFA::SubsetTable::Find(const Subset &subset) const
+{
+  std::size_t hash = Hash(subset), mask = buckets_.size()-1;
+  for (std::size_t i = hash & mask; buckets_[i] != 0; i = (i+1) & mask) {
+    const Entry &entry = entries_[buckets_[i]-1];
+    if (entry.hash == hash && Equal(entry, subset)) return entry.state;
+  }
+  return UNDEF;
+}
+
+void DFA::SubsetTable::Insert(const Subset &subset, state_t state)
+{
+  Entry entry;
+  entry.hash = Hash(subset);
+  entry.state = state;
+  entry.begin = positions_.size();
+  positions_.insert(positions_.end(), subset.begin(), subset.end());
+  entry.end = positions_.size();
+  entries_.push_back(entry);
+
+  // a state keeps the first subset inserted for it (minimized states).
+  if (state >= state_entry_.size()) state_entry_.resize(state+1, 0);
+  if (state_entry_[state] == 0) state_entry_[state] = entries_.size();
+
+  if (entries_.size()*2 > buckets_.size()) {
+    Rehash();
+  } else {
+    std::size_t mask = buckets_.size()-1, i = entry.hash & mask;
+    while (buckets_[i] != 0) i = (i+1) & mask;
+    buckets_[i] = entries_.size();
+  }
+}
+
+void DFA::SubsetTable::Get(state_t state, Subset *subset) const
+{
+  subset->clear();
+  if (state >= state_entry_.size() || state_entry_[state] == 0) return;
+  const Entry &entry = entries_[state_entry_[state]-1];
+  subset->insert(positions_.begin()+entry.begin, positions_.begin()+entry.end);
+}
+
+void DFA::SubsetTable::Rehash()
+{
+  buckets_.assign(buckets_.size()*2, 0);
+  std::size_t mask = buckets_.size()-1;
+  for (std::size_t e = 0; e < entries_.size(); e++) {
+    std::size_t i = entries_[e].hash & mask;
+    while (buckets_[i] != 0) i = (i+1) & mask;
+    buckets_[i] = e+1;
+  }
+}
+
+std::size_t DFA::SubsetTable::memory() const
+{
+  return buckets_.capacity() * sizeof(std::size_t) + entries_.capacity() * sizeof(Entry)
+      + positions_.capacity() * sizeof(StateExpr*) + state_entry_.capacity() * sizeof(std::size_t);
+}
+
+void DFA::SubsetTable::clear()
+{
+  buckets_.assign(16, 0);
+  entries_.clear();
+  positions_.clear();
+  state_entry_.clear();
+}
+
+void DFA::FillAlphabet() const
+{
+  std::fill(alphabet_.map, alphabet_.map+256, 0);
+  alphabet_.size = 1;
+
+  std::bitset<256> table;
+  table.set(flag_.delimiter());
+  alphabet_.Split(table);
+
+  Subset visited;
+  std::vector<StateExpr*> stack(expr_info_.expr_root->first().begin(),
+                                expr_info_.expr_root->first().end());
+  while (!stack.empty()) {
+    StateExpr *s = stack.back();
+    stack.pop_back();
+    if (!visited.insert(s).second) continue;
+    switch (s->type()) {
+      case Expr::kLiteral:
+        table.reset();
+        table.set(static_cast<Literal*>(s)->literal());
+        alphabet_.Split(table);
+        break;
+      case Expr::kCharClass: {
+        CharClass *cc = static_cast<CharClass*>(s);
+        table = cc->table();
+        if (cc->negative()) table.flip();
+        alphabet_.Split(table);
+        break;
+      }
+      default: break; // Dot and Anchor only distinguish the delimiter.
+    }
+    stack.insert(stack.end(), s->follow().begin(), s->follow().end());
+  }
+
+  alphabet_.Normalize();
+}
+
 void DFA::MakeNonGreedy(StateExpr* state) const {
   if (state->complete_non_greedy()) return;
   Subset follow_;
@@ -197,77 +361,121 @@ void DFA::TrimNonGreedy(Subset* states) const {
 bool DFA::Construct(std::size_t limit)
 {
   if (expr_info_.expr_root == NULL) return false;
-  
-  std::queue<Subset> queue;
-  std::vector<Subset> transition(256);
 
-  state_t dfa_id = 0;
-  bool limit_over = false, begline = true;
-  Subset states = expr_info_.expr_root->first();
+  if (!empty()) {
+    // discard states which was built by on-the-fly matching.
+    transition_.clear();
+    states_.clear();
+    subsets_.clear();
+    accept_.clear();
+    cache_generation_ = 0;
+  }
+  FillAlphabet();
 
-  ExpandStates(&states, begline);
-  if (ContainAcceptState(states)) TrimNonGreedy(&states);
-  queue.push(states);
-  
-  nfa_map_[dfa_id] = states;
-  dfa_map_[states] = dfa_id++;
+  const std::size_t k = alphabet_.size;
+  const std::size_t threads = std::max<std::size_t>(1, flag_.construct_threads());
+  const std::size_t batch_size = 64 * threads;
 
-  while (!queue.empty()) {
-    states = queue.front();
-    queue.pop();
-
-    std::fill(transition.begin(), transition.end(), Subset());
-    for (Subset::iterator iter = states.begin(); iter != states.end(); ++iter) {
-      FillTransition(*iter, &transition);
-    }
+  state_t dfa_id = 0, first = 0;
+  bool limit_over = false;
+  const uint64_t start_time = flag_.time_limit() != 0 ? Util::msec() : 0;
+  Subset states = expr_info_.expr_root->first();
 
-    State &state = get_new_state();
-    Transition &trans = transition_[state.id];
-    state.accept = ContainAcceptState(states);
-
-    if (!flag_.suffix_match() && flag_.shortest_match()) {
-      /* Leftmost-Shortest matching
-         if current state is accepted
-         then no more transitions are needed.
-       */
-      if (state.accept) {
-        trans.fill(REJECT);
-        state.dst_states.insert(REJECT);
-        begline = false;
-        continue;
+  ExpandStates(&states, true);
+  if (ContainAcceptState(states)) TrimNonGreedy(&states);
+  subsets_.Insert(states, dfa_id++);
+
+  /* states are expanded in batches (in order of their ids), successors of
+     a batch are computed by several threads and numbered sequentially,
+     so the result is identical to the breadth-first serial construction. */
+  ConstructBatch batch;
+  while (first < dfa_id) {
+    const std::size_t n = std::min<std::size_t>(batch_size, dfa_id - first);
+    batch.first = first;
+    batch.transitions.assign(n, std::vector<Subset>());
+    batch.next.assign(n * k, UNDEF);
+    batch.accept.assign(n, false);
+
+    // MakeNonGreedy modifies positions, so run it before sharing them.
+    for (std::size_t i = 0; i < n; i++) {
+      subsets_.Get(first + i, &states);
+      for (Subset::iterator iter = states.begin(); iter != states.end(); ++iter) {
+        if ((*iter)->non_greedy()) MakeNonGreedy(*iter);
       }
     }
 
-    // fill transitions of current state
-    for (std::size_t c = 0; c < 256; c++) {
-      Subset& next = transition[c];
-
-      if (next.empty()) {
-        trans[c] = REJECT;
-        state.dst_states.insert(REJECT);
-        continue;
+    std::size_t task_num = std::min(threads, (n + 7) / 8);
+#ifdef REGEN_ENABLE_PARALLEL
+    if (task_num > 1) {
+      boost::thread_group tasks;
+      for (std::size_t t = 1; t < task_num; t++) {
+        tasks.create_thread(boost::bind(&DFA::ConstructTask, this, &batch, t, task_num));
       }
-
-      ExpandStates(&next);
-      if (ContainAcceptState(next)) TrimNonGreedy(&next);
-      
-      if (dfa_map_.find(next) == dfa_map_.end()) {
-        if (dfa_id < limit) {
-          nfa_map_[dfa_id] = next;
-          dfa_map_[next] = dfa_id++;
-          queue.push(next); 
-        } else {
-          limit_over = true;
+      ConstructTask(&batch, 0, task_num);
+      tasks.join_all();
+    } else
+#endif
+    ConstructTask(&batch, 0, 1);
+
+    for (std::size_t i = 0; i < n; i++) {
+      State &state = get_new_state();
+      Transition trans = GetTransition(state.id);
+      state.accept = batch.accept[i];
+
+      if (!flag_.suffix_match() && flag_.shortest_match()) {
+        /* Leftmost-Shortest matching
+           if current state is accepted
+           then no more transitions are needed.
+        */
+        if (state.accept) {
+          trans.fill(REJECT);
+          state.dst_states.insert(REJECT);
           continue;
         }
       }
-      trans[c] = dfa_map_[next];
-      state.dst_states.insert(dfa_map_[next]);
+
+      // fill transitions of current state
+      for (std::size_t c = 0; c < k; c++) {
+        state_t next_id = batch.next[i*k+c];
+        if (next_id == UNDEF) {
+          // not known when the batch was expanded.
+          Subset &next = batch.transitions[i][c];
+          if ((next_id = subsets_.Find(next)) == UNDEF) {
+            if (dfa_id < limit) {
+              subsets_.Insert(next, dfa_id);
+              next_id = dfa_id++;
+            } else {
+              limit_over = true;
+              continue;
+            }
+          }
+        }
+        trans.at(c) = next_id;
+        state.dst_states.insert(next_id);
+      }
+    }
+    first += n;
+    if ((flag_.memory_limit() != 0 && CacheMemory() > flag_.memory_limit())
+        || (flag_.time_limit() != 0 && Util::msec() - start_time > flag_.time_limit())) {
+      limit_over = true;
+      break;
     }
-    begline = false;
   }
 
   if (limit_over) {
+    // keep the partial DFA as the on-the-fly DFA cache,
+    // states which are not expanded yet have undefined transitions.
+    while (size() < dfa_id) {
+      State &state = get_new_state();
+      subsets_.Get(state.id, &states);
+      state.accept = ContainAcceptState(states);
+    }
+    accept_.resize(size());
+    for (std::size_t i = 0; i < size(); i++) accept_[i] = states_[i].accept;
+    // the seed may exceed cache_size, states found lazily get a budget of their own.
+    cache_budget_ = CacheMemory() + flag_.cache_size();
+    ReserveCache();
+    cache_generation_ = 1;
     return false;
   } else {
     Finalize();
@@ -275,12 +483,41 @@ bool DFA::Construct(std::size_t limit)
   }
 }
 
+void DFA::ConstructTask(ConstructBatch *batch, std::size_t task, std::size_t task_num) const
+{
+  const std::size_t k = alphabet_.size;
+  Subset states;
+  for (std::size_t i = task; i < batch->transitions.size(); i += task_num) {
+    subsets_.Get(batch->first + i, &states);
+    batch->accept[i] = ContainAcceptState(states);
+    if (batch->accept[i] && !flag_.suffix_match() && flag_.shortest_match()) continue;
+
+    std::vector<Subset> &transition = batch->transitions[i];
+    transition.resize(k);
+    for (Subset::iterator iter = states.begin(); iter != states.end(); ++iter) {
+      FillTransition(*iter, &transition);
+    }
+    for (std::size_t c = 0; c < k; c++) {
+      Subset &next = transition[c];
+      if (next.empty()) {
+        batch->next[i*k+c] = REJECT;
+        continue;
+      }
+      ExpandStates(&next);
+      if (ContainAcceptState(next)) TrimNonGreedy(&next);
+      batch->next[i*k+c] = subsets_.Find(next);
+    }
+  }
+}
+
 bool DFA::Construct(const NFA &nfa, size_t limit)
 {
   state_t dfa_id = 0;
 
   typedef std::set<NFA::state_t> Subset_;
 
+  alphabet_.clear();
+
   std::map<std::set<NFA::state_t>, state_t> dfa_map;
   std::queue<Subset_> queue;
   const Subset_ &start_states = nfa.start_states();
@@ -303,7 +540,7 @@ bool DFA::Construct(const NFA &nfa, size_t limit)
     }
 
     State &state = get_new_state();
-    Transition &trans = transition_[state.id];
+    Transition trans = GetTransition(state.id);
     state.accept = accept;
     //Leftmost-Shortest matching
     if (!flag_.suffix_match() && flag_.shortest_match() && accept) {
@@ -344,15 +581,74 @@ void DFA::Finalize()
     }
   }
 
+  // acceptance, and acceptance at the end of input (bit 1: of empty input).
+  accept_.resize(size());
+  eol_accept_.resize(size());
+  Subset states;
+  for (std::size_t i = 0; i < size(); i++) {
+    accept_[i] = states_[i].accept;
+    subsets_.Get(i, &states);
+    ExpandStates(&states, false, true);
+    eol_accept_[i] = ContainAcceptState(states);
+  }
+  subsets_.Get(0, &states);
+  ExpandStates(&states, true, true);
+  eol_accept_[0] |= ContainAcceptState(states) << 1;
+
+  // state ids are truncated, REJECT and UNDEF remain the largest ids.
+  table_width_ = TableWidth(size());
+  table8_.clear();
+  table16_.clear();
+  switch (table_width_) {
+    case 1:
+      table8_.assign(transition_.begin(), transition_.end());
+      match_table_ = &table8_[0];
+      break;
+    case 2:
+      table16_.assign(transition_.begin(), transition_.end());
+      match_table_ = &table16_[0];
+      break;
+    default:
+      match_table_ = &transition_[0];
+      break;
+  }
+  match_accept_ = &accept_[0];
+  match_eol_ = &eol_accept_[0];
+  BuildStrideTable();
+
   complete_ = true;
 }
 
+void DFA::BuildStrideTable()
+{
+  const std::size_t k = alphabet_.size;
+  stride_table_.clear();
+  match_stride_ = NULL;
+  if (size() * k * k * table_width_ > flag_.stride_limit()) return;
+  stride_table_.resize(size() * k * k * table_width_);
+  for (std::size_t i = 0; i < size(); i++) {
+    for (std::size_t c1 = 0; c1 < k; c1++) {
+      const state_t mid = transition_[i*k+c1];
+      for (std::size_t c2 = 0; c2 < k; c2++) {
+        const state_t next = mid == REJECT ? REJECT : transition_[mid*k+c2];
+        const std::size_t index = (i*k+c1)*k+c2;
+        switch (table_width_) {
+          case 1: stride_table_[index] = next; break;
+          case 2: ((uint16_t*)&stride_table_[0])[index] = next; break;
+          default: ((state_t*)&stride_table_[0])[index] = next; break;
+        }
+      }
+    }
+  }
+  match_stride_ = &stride_table_[0];
+}
+
 DFA::State& DFA::get_new_state() const
 {
-  transition_.resize(states_.size()+1);
+  transition_.resize((states_.size()+1)*alphabet_.size, UNDEF);
   states_.resize(states_.size()+1);
   State &new_state = states_.back();
-  new_state.transitions = &transition_;
+  new_state.dfa = this;
   new_state.id = states_.size()-1;
   new_state.alter_transition.next1 = UNDEF;
   return new_state;
@@ -368,105 +664,271 @@ void DFA::state2label(state_t state, char* labelbuf) const
   }
 }
 
-bool DFA::Minimize()
+/* Hopcroft's partition refinement (splitters are whole blocks, as in
+ * Valmari & Lehtinen), O(n k log n) for n states and k byte classes.
+ * REJECT is treated as an ordinary (sink) state (size()), so dead states
+ * are merged into it. states of the same key start in the same block,
+ * blk[s] is the block of s, returns the number of blocks. */
+std::size_t DFA::Refine(const std::vector<std::size_t> &key, std::vector<std::size_t> *blk_) const
 {
-  if (!complete_) return false;
-  if (minimum_) return true;
-  
-  std::vector<std::vector<bool> > distinction_table;
-  distinction_table.resize(size()-1);
-  for (state_t i = 0; i < size()-1; i++) {
-    distinction_table[i].resize(size()-i-1);
-    for (state_t j = i+1; j < size(); j++) {
-      distinction_table[i][size()-j-1] = states_[i].accept != states_[j].accept;
-    }
-  }
-
-  bool distinction_flag = true;
-  while (distinction_flag) {
-    distinction_flag = false;
-    for (state_t i = 0; i < size()-1; i++) {
-      for (state_t j = i+1; j < size(); j++) {
-        if (!distinction_table[i][size()-j-1]) {
-          for (std::size_t input = 0; input < 256; input++) {
-            state_t n1, n2;
-            n1 = transition_[i][input];
-            n2 = transition_[j][input];
-            if (n1 != n2) {
-              if (n1 > n2) std::swap(n1, n2);
-              if ((n1 == REJECT || n2 == REJECT) ||
-                  distinction_table[n1][size()-n2-1]) {
-                distinction_flag = true;
-                distinction_table[i][size()-j-1] = true;
-                break;
-              }
-            }
-          }
-        }
+  const std::size_t n = size() + 1, sink = size(), k = alphabet_.size;
+  std::vector<std::size_t> &blk = *blk_;
+
+  // inverse transitions, grouped by (class, target).
+  std::vector<std::size_t> inv_begin(k*n+1);
+  std::vector<state_t> inv(k*n);
+  for (std::size_t s = 0; s < n; s++) {
+    for (std::size_t c = 0; c < k; c++) {
+      state_t t = s == sink ? REJECT : transition_[s*k+c];
+      inv_begin[c*n+(t == REJECT ? sink : t)+1]++;
+    }
+  }
+  for (std::size_t i = 0; i < k*n; i++) inv_begin[i+1] += inv_begin[i];
+  std::vector<std::size_t> fill(inv_begin.begin(), inv_begin.end()-1);
+  for (std::size_t s = 0; s < n; s++) {
+    for (std::size_t c = 0; c < k; c++) {
+      state_t t = s == sink ? REJECT : transition_[s*k+c];
+      inv[fill[c*n+(t == REJECT ? sink : t)]++] = s;
+    }
+  }
+
+  std::vector<std::size_t> elems(n), loc(n);
+  std::vector<std::size_t> first, last, marked;
+  blk.resize(n);
+  {
+    std::map<std::size_t, std::size_t> key2blk;
+    for (std::size_t s = 0; s < n; s++) {
+      if (key2blk.find(key[s]) == key2blk.end()) {
+        key2blk[key[s]] = first.size();
+        first.push_back(0);
+        last.push_back(0);
+        marked.push_back(0);
       }
+      blk[s] = key2blk[key[s]];
+      last[blk[s]]++;
+    }
+    for (std::size_t b = 0, offset = 0; b < first.size(); b++) {
+      first[b] = offset;
+      offset += last[b];
+      last[b] = first[b];
+    }
+    for (std::size_t s = 0; s < n; s++) {
+      loc[s] = last[blk[s]]++;
+      elems[loc[s]] = s;
     }
   }
-  
-  std::map<state_t, state_t> swap_map;
-  for (state_t i = 0; i < size()-1; i++) {
-    for (state_t j = i+1; j < size(); j++) {
-      if (swap_map.find(j) == swap_map.end()) {
-        if (!distinction_table[i][size()-j-1]) {
-          swap_map[j] = i;
+
+  std::vector<std::size_t> worklist;
+  std::vector<bool> in_worklist(first.size());
+  {
+    std::size_t largest = 0;
+    for (std::size_t b = 1; b < first.size(); b++) {
+      if (last[b]-first[b] > last[largest]-first[largest]) largest = b;
+    }
+    for (std::size_t b = 0; b < first.size(); b++) {
+      if (b == largest) continue;
+      worklist.push_back(b);
+      in_worklist[b] = true;
+    }
+  }
+
+  std::vector<std::size_t> splitter, touched;
+  while (!worklist.empty()) {
+    std::size_t a = worklist.back();
+    worklist.pop_back();
+    in_worklist[a] = false;
+    splitter.assign(elems.begin()+first[a], elems.begin()+last[a]);
+
+    for (std::size_t c = 0; c < k; c++) {
+      // mark predecessors (move them to the front of their block).
+      for (std::size_t i = 0; i < splitter.size(); i++) {
+        std::size_t t = splitter[i];
+        for (std::size_t j = inv_begin[c*n+t]; j < inv_begin[c*n+t+1]; j++) {
+          std::size_t s = inv[j], b = blk[s];
+          std::size_t pos = first[b] + marked[b];
+          if (loc[s] < pos) continue;
+          if (marked[b] == 0) touched.push_back(b);
+          std::swap(elems[loc[s]], elems[pos]);
+          loc[elems[loc[s]]] = loc[s];
+          loc[s] = pos;
+          marked[b]++;
         }
       }
+      // split touched blocks: marked part becomes a new block.
+      for (std::size_t i = 0; i < touched.size(); i++) {
+        std::size_t b = touched[i], m = marked[b];
+        marked[b] = 0;
+        if (m == last[b] - first[b]) continue;
+        std::size_t nb = first.size();
+        first.push_back(first[b]);
+        last.push_back(first[b]+m);
+        marked.push_back(0);
+        first[b] += m;
+        for (std::size_t j = first[nb]; j < last[nb]; j++) blk[elems[j]] = nb;
+        if (in_worklist[b] || m <= last[b] - first[b]) {
+          worklist.push_back(nb);
+          in_worklist.push_back(true);
+        } else {
+          worklist.push_back(b);
+          in_worklist[b] = true;
+          in_worklist.push_back(false);
+        }
+      }
+      touched.clear();
     }
   }
 
-  if (swap_map.empty()) {
+  return first.size();
+}
+
+bool DFA::Minimize()
+{
+  if (!complete_) return false;
+  if (minimum_) return true;
+  if (olevel_ >= Regen::Options::O1) return false; // native code refers to current states.
+  if (image_ != NULL) return false;
+
+  const std::size_t n = size() + 1, sink = size(), k = alphabet_.size;
+
+  // initial partition: states are distinguished by acceptance,
+  // and by acceptance at the end of input (end-line anchors).
+  std::vector<std::size_t> key(n), blk;
+  for (std::size_t s = 0; s < sink; s++) {
+    Subset endstates;
+    subsets_.Get(s, &endstates);
+    ExpandStates(&endstates, false, true);
+    key[s] = states_[s].accept | states_[s].endline << 1
+        | ContainAcceptState(endstates) << 2;
+  }
+  const std::size_t blocks = Refine(key, &blk);
+
+  if (blocks == n) {
     minimum_ = true;
     return true;
   }
 
-  size_t minimum_size = size() - swap_map.size();
-  std::vector<state_t> replace_map(size());
-  for (state_t s = 0, d = 0; s < size(); s++) {
-    if (swap_map.find(s) == swap_map.end()) {
-      replace_map[s] = d++;
-      if (s != replace_map[s]) {
-        transition_[replace_map[s]] = transition_[s];
-        states_[replace_map[s]] = states_[s];
-        states_[replace_map[s]].id = replace_map[s];
-      }
+  // number blocks by their smallest state (start state remains 0),
+  // the block of the sink becomes REJECT unless it holds the start state.
+  std::vector<state_t> replace_map(blocks, UNDEF);
+  std::vector<state_t> rep;
+  for (std::size_t s = 0; s < n; s++) {
+    std::size_t b = blk[s];
+    if (replace_map[b] != UNDEF) continue;
+    if (b == blk[sink] && s != 0) {
+      replace_map[b] = REJECT;
     } else {
-      replace_map[s] = replace_map[swap_map[s]];
+      replace_map[b] = rep.size();
+      rep.push_back(s);
     }
   }
 
-  std::set<state_t> tmp_set;
-  for (iterator state_iter = begin(); state_iter->id < minimum_size; ++state_iter) {
-    State &state = *state_iter;
-    for (std::size_t input = 0; input < 256; input++) {
-      state_t n = state[input];
-      if (n != REJECT) {
-        state[input] = replace_map[n];
-      }
-    }
-    tmp_set.clear();
-    for (std::set<state_t>::iterator iter = state.dst_states.begin(); iter != state.dst_states.end(); ++iter) {
-      if (*iter != REJECT) tmp_set.insert(replace_map[*iter]);
-      else tmp_set.insert(REJECT);
+  std::vector<state_t> transition(rep.size()*k);
+  std::deque<State> states(rep.size());
+  for (std::size_t i = 0; i < rep.size(); i++) {
+    state_t r = rep[i];
+    State &state = states[i];
+    state.dfa = this;
+    state.id = i;
+    state.alter_transition.next1 = UNDEF;
+    state.accept = states_[r].accept;
+    state.endline = states_[r].endline;
+    for (std::size_t c = 0; c < k; c++) {
+      state_t next = transition_[r*k+c];
+      if (next != REJECT) next = replace_map[blk[next]];
+      transition[i*k+c] = next;
+      state.dst_states.insert(next);
     }
-    state.dst_states = tmp_set;
-    tmp_set.clear();
-    for (std::set<state_t>::iterator iter = state.src_states.begin(); iter != state.src_states.end(); ++iter) {
-      tmp_set.insert(replace_map[*iter]);
-    }
-    state.src_states = tmp_set;
   }
 
-  transition_.resize(minimum_size);
-  states_.resize(minimum_size);
+  // states are visited in ascending order, so each block keeps
+  // the subset of its representative.
+  SubsetTable subsets;
+  Subset subset;
+  for (std::size_t s = 0; s < sink; s++) {
+    state_t next = replace_map[blk[s]];
+    if (next == REJECT) continue;
+    subsets_.Get(s, &subset);
+    subsets.Insert(subset, next);
+  }
+
+  transition_.swap(transition);
+  states_.swap(states);
+  std::swap(subsets_, subsets);
+  Finalize();
 
   minimum_ = true;
   return true;
 }
 
+bool DFA::Save(std::string *image) const
+{
+  if (!complete_) return false;
+  const std::size_t n = image_ != NULL ? image_->state_num : size();
+  Image header;
+  memset(&header, 0, sizeof(header));
+  header.state_num = n;
+  header.alphabet_size = alphabet_.size;
+  header.table_width = table_width_;
+  header.table_offset = (sizeof(Image) + 2 * n + 7) & ~7;
+  header.size = header.table_offset + n * alphabet_.size * table_width_;
+  std::copy(alphabet_.map, alphabet_.map+256, header.alphabet);
+
+  const std::size_t base = image->size();
+  image->append(reinterpret_cast<const char*>(&header), sizeof(header));
+  image->append(reinterpret_cast<const char*>(match_accept_), n);
+  image->append(reinterpret_cast<const char*>(match_eol_), n);
+  image->resize(base + header.table_offset, 0);
+  image->append(static_cast<const char*>(match_table_), n * alphabet_.size * table_width_);
+  return true;
+}
+
+bool DFA::ValidImage(const Image *header, std::size_t size)
+{
+  if (header->state_num == 0 || header->table_width != TableWidth(header->state_num)
+      || header->alphabet_size == 0 || header->alphabet_size > 256
+      || header->size > size
+      || header->table_offset < sizeof(Image) + 2 * (uint64_t)header->state_num
+      || header->table_offset > header->size
+      || (uint64_t)header->state_num * header->alphabet_size * header->table_width
+      > header->size - header->table_offset) return false;
+  Alphabet alphabet;
+  std::copy(header->alphabet, header->alphabet+256, alphabet.map);
+  alphabet.Normalize();
+  if (alphabet.size != header->alphabet_size) return false;
+  // a transition is a state of the table or REJECT (all bits set).
+  const char *table = reinterpret_cast<const char*>(header) + header->table_offset;
+  const std::size_t n = (std::size_t)header->state_num * header->alphabet_size;
+  const uint32_t reject = header->table_width == 1 ? 0xff : header->table_width == 2 ? 0xffff : 0xffffffff;
+  for (std::size_t i = 0; i < n; i++) {
+    uint32_t next;
+    switch (header->table_width) {
+      case 1: next = reinterpret_cast<const uint8_t*>(table)[i]; break;
+      case 2: next = reinterpret_cast<const uint16_t*>(table)[i]; break;
+      default: next = reinterpret_cast<const uint32_t*>(table)[i]; break;
+    }
+    if (next != reject && next >= header->state_num) return false;
+  }
+  return true;
+}
+
+bool DFA::Map(const char *image)
+{
+  // tables are used in place (no copies), the image must outlive the DFA.
+  const Image *header = reinterpret_cast<const Image*>(image);
+  if (!ValidImage(header, header->size)) return false;
+  std::copy(header->alphabet, header->alphabet+256, alphabet_.map);
+  alphabet_.Normalize();
+
+  image_ = header;
+  table_width_ = header->table_width;
+  match_accept_ = reinterpret_cast<const uint8_t*>(image + sizeof(Image));
+  match_eol_ = match_accept_ + header->state_num;
+  match_table_ = image + header->table_offset;
+  complete_ = true;
+  olevel_ = Regen::Options::O0;
+  return true;
+}
+
 void DFA::Complementify()
 {
   state_t reject = REJECT;
@@ -476,19 +938,17 @@ void DFA::Complementify()
       state.accept = !state.accept;
     }
     bool to_reject = false;
-    for (std::size_t i = 0; i < 256; i++) {
-      if (state[i] == REJECT) {
+    for (std::size_t i = 0; i < alphabet_.size; i++) {
+      if (GetTransition(state.id).at(i) == REJECT) {
         if (reject == REJECT) {
           State &reject_state = get_new_state();
           reject = reject_state.id;
-          for (std::size_t j = 0; j < 256; j++) {
-            reject_state[j] = reject;
-          }
+          GetTransition(reject).fill(reject);
           reject_state.dst_states.insert(reject);
           reject_state.accept = true;
         }
         to_reject = true;
-        state[i] = reject;
+        GetTransition(state.id).at(i) = reject;
       }
     }
     if (to_reject) {
@@ -499,24 +959,73 @@ void DFA::Complementify()
 }
 
 #if REGEN_ENABLE_JIT
-JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
+void JITCompiler::JumpState(const Xbyak::Reg32e &tbl, const Xbyak::Reg32e &index, const Xbyak::Reg32e &tmp)
+{
+#ifdef XBYAK32
+  mov(tmp, dword[tbl+address_offset+index*sizeof(int32_t)]);
+#else
+  movsxd(static_cast<const Xbyak::Reg64&>(tmp), dword[tbl+address_offset+index*sizeof(int32_t)]);
+#endif
+  add(tmp, tbl);
+  jmp(tmp);
+}
+
+bool JITCompiler::SkipExits(const DFA &dfa, std::size_t state, std::vector<unsigned char> *exits)
+{
+  exits->clear();
+  for (std::size_t c = 0; c < 256; c++) {
+    if (dfa[state][c] != state) {
+      if (exits->size() == skip_exits) return false;
+      exits->push_back(c);
+    }
+  }
+  return !exits->empty();
+}
+
+std::size_t JITCompiler::skip_state_num(const DFA &dfa)
+{
+  std::vector<unsigned char> exits;
+  std::size_t skip_num = 0;
+  for (std::size_t i = 0; i < dfa.size(); i++) {
+    if (SkipExits(dfa, i, &exits)) skip_num++;
+  }
+  return skip_num;
+}
+
+JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64, bool count):
     /* code segment for state transition.
      *   each states code was 16byte alligned.
      *                        ~~
      *   padding for 4kb allign between code and data
      *                        ~~
-     * data segment for transition table
+     * data segment for byte class map and transition table
      *                                                */
-    CodeGenerator(code_segment_size(dfa.size()) + data_segment_size(dfa.size())),
-    code_segment_size_(code_segment_size(dfa.size())),
-    data_segment_size_(data_segment_size(dfa.size())),
-    total_segment_size_(code_segment_size(dfa.size())+data_segment_size(dfa.size())), filter_entry_(NULL),
+    CodeGenerator(code_segment_size(dfa.size(), skip_state_num(dfa), dfa.HasStrideTable(), count)
+                  + data_segment_size(dfa.size(), dfa.alphabet().size, dfa.table_width(), skip_state_num(dfa), dfa.HasStrideTable())),
+    code_segment_size_(code_segment_size(dfa.size(), skip_state_num(dfa), dfa.HasStrideTable(), count)),
+    data_segment_size_(data_segment_size(dfa.size(), dfa.alphabet().size, dfa.table_width(), skip_state_num(dfa), dfa.HasStrideTable())),
+    total_segment_size_(code_segment_size_+data_segment_size_), filter_entry_(NULL),
     reset_state_(DFA::UNDEF)
 {
   states_addr_.resize(dfa.size());
 
   const uint8_t* code_addr_top = getCurr();
-  const uint8_t** transition_table_ptr = (const uint8_t **)(code_addr_top + code_segment_size_);
+  uint8_t* alphabet_ptr = (uint8_t *)(code_addr_top + code_segment_size_);
+  uint8_t* filter_ptr = alphabet_ptr + filter_offset;
+  int32_t* address_table_ptr = (int32_t *)(alphabet_ptr + address_offset);
+  uint8_t* transition_table_ptr = (uint8_t *)(address_table_ptr + dfa.size() + 2);
+  const std::size_t alphabet_size = dfa.alphabet().size;
+  // identity map (every byte has own class) needs no class lookup.
+  const bool use_alphabet = alphabet_size < 256;
+  // transitions hold (narrow) indexes of address table:
+  // states, reject (size()) and filter (size()+1).
+  const std::size_t width = dfa.table_width();
+  const std::size_t table_offset = address_offset + (dfa.size() + 2) * sizeof(int32_t);
+  const std::size_t skip_table_offset = skip_offset(dfa.size(), alphabet_size, width);
+  const std::size_t stride_table_offset = stride_offset(dfa.size(), alphabet_size, width, skip_state_num(dfa));
+  uint8_t* stride_table_ptr = alphabet_ptr + stride_table_offset;
+  std::vector<unsigned char> exits;
+  std::vector<std::vector<unsigned char> > skip_exits_table;
 
 #ifdef XBYAK32
   const Xbyak::Reg32& arg1(ecx);
@@ -552,21 +1061,47 @@ JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
 #endif
   // setup enviroment on register
   const int sign = dfa.flag().reverse_match() ? -1 : 1;
+  /* filtered matching restarts (from the reset state) after a skip,
+     the reset state is reached by a byte which is not involved in regex. */
+  std::string keyword;
+  if (dfa.flag().filtered_match()) {
+    keyword = dfa.expr_info().key.longest_keyword().substr(0, 8);
+    for (std::size_t i = 0; i < 256 && reset_state_ == DFA::UNDEF; i++) {
+      if (!dfa.expr_info().involve[i]) reset_state_ = dfa[0][i];
+    }
+  }
+#if defined(XBYAK32) || defined(XBYAK64_WIN)
+  const bool keyword_filter = false;
+#else
+  const bool keyword_filter = keyword.size() > 1 && sign == 1 && reset_state_ != DFA::UNDEF;
+#endif
   push(arg2);
   push(arg1);
-  mov(tbl, (size_t)transition_table_ptr);
+  // data segment is addressed relative to the code (position independent).
+#ifdef XBYAK32
+  call("@f");
+  L("@@");
+  const uint8_t *pc = getCurr();
+  pop(tbl);
+  add(tbl, (uint32_t)(alphabet_ptr - pc));
+#else
+  lea(tbl, ptr[rip]);
+  const uint8_t *pc = getCurr();
+  *(int32_t*)(pc - sizeof(int32_t)) = alphabet_ptr - pc;
+#endif
   mov(tmp2, 0);
+  if (keyword_filter) push(tmp2); // the last keyword occurrence found.
   mov(arg2, ptr[arg1+sizeof(uint8_t*)]);
   mov(arg1, ptr[arg1]);
 
-  mov(tmp1, (std::size_t)&(states_addr_[0]));
-  jmp(ptr[tmp1+arg3*sizeof(uint8_t*)]);
+  JumpState(tbl, arg3, tmp1);
 
   L("reject");
   const uint8_t *reject_state_addr = getCurr();
   mov(reg_a, DFA::REJECT); // return false
 
   L("return");
+  if (keyword_filter) pop(tmp1);
   pop(tmp1);
   mov(ptr[tmp1], arg1);
   pop(tmp1);
@@ -586,55 +1121,195 @@ JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
   
   align(16);
 
-  if (dfa.flag().filtered_match()) {
-    /* generate filter code conditionaly. */
-    if (dfa.expr_info().key.longest_keyword().length() > 1) {
-      /* regex has keyword (which will be contained acceptable string certainly).
-         so, we can try to search keyword firstly. */
-      if (mie::isAvaiableSSE42()) {
-        /* fastest keyword search with SSE4.2. */
-      } else {
-        /* or simple quick search algorithm. */
-      }
-    } else if (dfa.expr_info().key.longest_keyword().length() > 1) {
-      /* memchr */
-      
-    }
-    else if (dfa.expr_info().involve.count() < 126 && dfa.expr_info().min_length > 2) {
-      /* (cheap but effective) quick filter. */
-      std::size_t len = dfa.expr_info().min_length;
-      filter_entry_ = getCurr();
-      filter_table_.resize(256);
-      mov(reg_a, (size_t)&(filter_table_[0]));
-      const uint8_t *quick_filter_main = getCurr();
-      add(arg1, (len - 1) * sign);
-      if (dfa.flag().reverse_match()) {
-        cmp(arg2, arg1);
-      } else { 
-        cmp(arg1, arg2);
-      }
-      jge("reject", T_NEAR);
-      movzx(tmp1, byte[arg1]);
-      jmp(ptr[reg_a+tmp1*sizeof(uint8_t*)]);
-
-      const uint8_t *quick_filter_end = getCurr();
-      sub(arg1, (len - 1) * sign);
-    
-      for (std::size_t i = 0; i < 256; i++) {
-        if (dfa.expr_info().involve[i]) {
-          filter_table_[i] = quick_filter_end;
-        } else {
-          if (reset_state_ == DFA::UNDEF) reset_state_ = dfa[0][i];
-          filter_table_[i] = quick_filter_main;
-        }
-      }
+  if (count) {
+    /* count the line, and restart after its delimiter (the counter
+       is held by tmp2, and returned as the match end). a match of a
+       state other than the start ends with its delimiter ($) already. */
+    const Xbyak::Reg32 mask(reg_a.getIdx());
+    const unsigned char delimiter = dfa.flag().delimiter();
+    L("count_end");
+    cmp(byte[arg1-1], delimiter);
+    jne("count");
+    add(tmp2, 1);
+    jmp("count_restart");
+    L("count");
+    inLocalLabel();
+    add(tmp2, 1);
+    mov(mask, delimiter * 0x01010101u);
+    movd(xmm0, mask);
+    pshufd(xmm0, xmm0, 0);
+    L(".vector");
+    lea(tmp1, ptr[arg1+16]);
+    cmp(tmp1, arg2);
+    ja(".byte");
+    movdqu(xmm1, ptr[arg1]);
+    pcmpeqb(xmm1, xmm0);
+    pmovmskb(mask, xmm1);
+    test(mask, mask);
+    jnz(".found");
+    add(arg1, 16);
+    jmp(".vector");
+    L(".found");
+    bsf(mask, mask);
+    add(arg1, reg_a);
+    jmp(".next");
+    L(".byte");
+    cmp(arg1, arg2);
+    je(".last");
+    cmp(byte[arg1], delimiter);
+    je(".next");
+    add(arg1, 1);
+    jmp(".byte");
+    L(".next");
+    add(arg1, 1);
+    L("count_restart");
+    cmp(arg1, arg2);
+    je(".end");
+    char labelbuf[100];
+    dfa.state2label(0, labelbuf);
+    jmp(labelbuf, T_NEAR);
+    L(".end");
+    mov(reg_a, DFA::UNDEF); // an empty line is left.
+    jmp("return", T_NEAR);
+    L(".last");
+    mov(reg_a, DFA::REJECT);
+    jmp("return", T_NEAR);
+    outLocalLabel();
+    align(16);
+  }
 
-      char labelbuf[100];
-      dfa.state2label(reset_state_, labelbuf);
-      jmp(labelbuf, T_NEAR);
-    
-      align(16);
+  if (keyword_filter) {
+#if !defined(XBYAK32) && !defined(XBYAK64_WIN)
+    /* regex has keyword (which will be contained acceptable string certainly).
+       so, we search the keyword firstly, no match starts before
+       (keyword's position + keyword's length - max_length). */
+    const std::size_t len = keyword.size();
+    const std::size_t max_length = dfa.expr_info().max_length;
+    const Xbyak::Reg64 &ptr_(r9);
+    filter_entry_ = getCurr();
+    inLocalLabel();
+    mov(reg_a, ptr[rsp]);
+    cmp(reg_a, arg1);
+    jae(".skip", T_NEAR);
+    mov(ptr_, arg1);
+    if (mie::isAvaiableSSE42()) {
+      /* fastest keyword search with SSE4.2, index of the first keyword
+         occurrence in 16 bytes (partial occurrences are beyond 16 - len),
+         windows overlap to keep the loop independent of the index. */
+      movdqu(xmm0, ptr[tbl+keyword_offset]);
+      mov(eax, len);
+      mov(edx, 16);
+      L(".sse42");
+      lea(rcx, ptr[ptr_+16]);
+      cmp(rcx, arg2);
+      ja(".tail", T_NEAR);
+      pcmpestri(xmm0, ptr[ptr_], 0x0C); // unsigned bytes, equal ordered.
+      cmp(ecx, 16 - len);
+      jbe(".hit");
+      add(ptr_, 16 - len + 1);
+      jmp(".sse42");
+      L(".hit");
+      add(ptr_, rcx);
+      jmp(".found", T_NEAR);
+    } else {
+      /* or SSE2 search of the first and the last byte of keyword. */
+      movdqu(xmm1, ptr[tbl+keyword_offset+16]);
+      movdqu(xmm2, ptr[tbl+keyword_offset+32]);
+      L(".sse2");
+      lea(rcx, ptr[ptr_+16+len-1]);
+      cmp(rcx, arg2);
+      ja(".tail", T_NEAR);
+      movdqu(xmm3, ptr[ptr_]);
+      pcmpeqb(xmm3, xmm1);
+      movdqu(xmm4, ptr[ptr_+len-1]);
+      pcmpeqb(xmm4, xmm2);
+      pand(xmm3, xmm4);
+      pmovmskb(edx, xmm3);
+      test(edx, edx);
+      jz(".next16", T_NEAR);
+      L(".candidate");
+      bsf(ecx, edx);
+      lea(tmp1, ptr[ptr_+rcx]);
+      mov(eax, 1);
+      L(".verify");
+      cmp(eax, len - 1);
+      jae(".verified");
+      movzx(ecx, byte[tmp1+rax]);
+      cmp(cl, byte[tbl+keyword_offset+rax]);
+      jne(".mismatch");
+      inc(eax);
+      jmp(".verify");
+      L(".verified");
+      mov(ptr_, tmp1);
+      jmp(".found", T_NEAR);
+      L(".mismatch");
+      lea(eax, ptr[rdx-1]);
+      and(edx, eax);
+      jnz(".candidate");
+      L(".next16");
+      add(ptr_, 16);
+      jmp(".sse2");
     }
+    // less than a vector of bytes are left.
+    L(".tail");
+    lea(rcx, ptr[ptr_+len]);
+    cmp(rcx, arg2);
+    ja("reject", T_NEAR);
+    xor(eax, eax);
+    L(".compare");
+    movzx(ecx, byte[ptr_+rax]);
+    cmp(cl, byte[tbl+keyword_offset+rax]);
+    jne(".next");
+    inc(eax);
+    cmp(eax, len);
+    jb(".compare");
+    jmp(".found");
+    L(".next");
+    inc(ptr_);
+    jmp(".tail");
+
+    L(".found");
+    mov(ptr[rsp], ptr_);
+    mov(reg_a, ptr_);
+    L(".skip");
+    if (max_length != std::numeric_limits<std::size_t>::max() && max_length - len < 0x7fffffff) {
+      // and the byte before the match is scanned (a line anchor may need it).
+      cmp(reg_a, max_length - len + 1);
+      jb(".restart");
+      sub(reg_a, max_length - len + 1);
+      cmp(reg_a, arg1);
+      cmova(arg1, reg_a);
+    }
+    L(".restart");
+    outLocalLabel();
+    char labelbuf[100];
+    dfa.state2label(reset_state_, labelbuf);
+    jmp(labelbuf, T_NEAR);
+    align(16);
+#endif
+  } else if (dfa.flag().filtered_match() && reset_state_ != DFA::UNDEF
+             && dfa.expr_info().involve.count() < 126 && dfa.expr_info().min_length > 2) {
+    /* (cheap but effective) quick filter. */
+    std::size_t len = dfa.expr_info().min_length;
+    filter_entry_ = getCurr();
+    L("quick_filter_main");
+    add(arg1, (len - 1) * sign);
+    if (dfa.flag().reverse_match()) {
+      cmp(arg2, arg1);
+    } else { 
+      cmp(arg1, arg2);
+    }
+    jge("reject", T_NEAR);
+    movzx(tmp1, byte[arg1]);
+    cmp(byte[tbl+filter_offset+tmp1], 0);
+    je("quick_filter_main");
+
+    sub(arg1, (len - 1) * sign);
+    char labelbuf[100];
+    dfa.state2label(reset_state_, labelbuf);
+    jmp(labelbuf, T_NEAR);
+  
+    align(16);
   }
   
   char labelbuf[100];
@@ -643,13 +1318,61 @@ JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
     dfa.state2label(i, labelbuf);
     L(labelbuf);
     states_addr_[i] = getCurr();
-    if (dfa.IsAcceptState(i) && !dfa.flag().suffix_match()) {
+    if (count && dfa.IsAcceptState(i)) {
+      jmp(i == 0 ? "count" : "count_end", T_NEAR);
+    } else if (dfa.IsAcceptState(i) && !dfa.flag().suffix_match()) {
       mov(tmp2, arg1);
       if (dfa.flag().shortest_match()) {
         mov(reg_a, i);
         jmp("return");
       }
     }
+    // skip the self loop, 16 bytes at a time (a restart is left to the filter).
+    if (SkipExits(dfa, i, &exits) && !(filter_entry_ != NULL && i == reset_state_)) {
+      const std::size_t offset = skip_table_offset + skip_exits_table.size() * skip_exits * 16;
+      const Xbyak::Reg32 mask(tmp1.getIdx());
+      skip_exits_table.push_back(exits);
+      inLocalLabel();
+      for (std::size_t j = 0; j < exits.size(); j++) {
+        movdqu(Xbyak::Xmm(2+j), ptr[tbl+offset+j*16]);
+      }
+      L(".skip");
+      if (sign > 0) {
+        lea(tmp1, ptr[arg1+16]);
+        cmp(tmp1, arg2);
+        ja(".done");
+        movdqu(xmm0, ptr[arg1]);
+      } else {
+        lea(tmp1, ptr[arg1-16]);
+        cmp(tmp1, arg2);
+        jb(".done");
+        movdqu(xmm0, ptr[arg1-15]);
+      }
+      movdqa(xmm1, xmm2);
+      pcmpeqb(xmm1, xmm0);
+      for (std::size_t j = 1; j < exits.size(); j++) {
+        movdqa(xmm5, Xbyak::Xmm(2+j));
+        pcmpeqb(xmm5, xmm0);
+        por(xmm1, xmm5);
+      }
+      pmovmskb(mask, xmm1);
+      test(mask, mask);
+      jnz(".exit");
+      add(arg1, 16 * sign);
+      jmp(".skip");
+      L(".exit");
+      if (sign > 0) {
+        bsf(mask, mask);
+        add(arg1, tmp1);
+      } else {
+        bsr(mask, mask);
+        lea(arg1, ptr[arg1+tmp1-15]);
+      }
+      L(".done");
+      outLocalLabel();
+      // the skipped bytes (but not the exit byte) are accepted.
+      if (dfa.IsAcceptState(i) && !dfa.flag().suffix_match()) mov(tmp2, arg1);
+    }
     // can transition without table lookup ?
     const DFA::AlterTrans &at = dfa[i].alter_transition;
     if (dfa.olevel() >= Regen::Options::O2 && at.next1 != DFA::UNDEF) {
@@ -735,7 +1458,13 @@ JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
         je("@f", T_NEAR);
         movzx(tmp1, byte[arg1]);
         add(arg1, sign);
-        jmp(ptr[tbl+i*256*sizeof(uint8_t*)+tmp1*sizeof(uint8_t*)]);
+        if (use_alphabet) movzx(tmp1, byte[tbl+tmp1]);
+        switch (width) {
+          case 1: movzx(tmp1, byte[tbl+table_offset+i*alphabet_size+tmp1]); break;
+          case 2: movzx(tmp1, word[tbl+table_offset+i*alphabet_size*2+tmp1*2]); break;
+          default: mov(Xbyak::Reg32(tmp1.getIdx()), dword[tbl+table_offset+i*alphabet_size*4+tmp1*4]); break;
+        }
+        JumpState(tbl, tmp1, tmp1);
         L("@@");
         mov(reg_a, i);
         jmp("return");
@@ -746,11 +1475,55 @@ JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
       }
       outLocalLabel();
     } else {
+      /* two bytes per transition, unless the intermediate state could
+         accept (the match end would be lost). */
+      bool stride = dfa.HasStrideTable();
+      for (std::size_t c = 0; stride && c < alphabet_size; c++) {
+        stride = !(dfa.IsAcceptState(dfa.GetTransition(i).at(c)) && !dfa.flag().suffix_match());
+      }
+      if (stride) {
+        inLocalLabel();
+        lea(tmp1, ptr[arg1+2*sign]);
+        cmp(tmp1, arg2);
+        if (sign > 0) {
+          ja(".single");
+        } else {
+          jb(".single");
+        }
+        movzx(tmp1, byte[arg1]);
+        movzx(reg_a, byte[arg1+sign]);
+        if (use_alphabet) {
+          movzx(tmp1, byte[tbl+tmp1]);
+          movzx(reg_a, byte[tbl+reg_a]);
+        }
+        if (alphabet_size == 256) {
+          shl(tmp1, 8);
+        } else {
+          imul(tmp1, tmp1, alphabet_size);
+        }
+        add(tmp1, reg_a);
+        add(arg1, 2*sign);
+        const std::size_t offset = stride_table_offset + i*alphabet_size*alphabet_size*width;
+        switch (width) {
+          case 1: movzx(tmp1, byte[tbl+offset+tmp1]); break;
+          case 2: movzx(tmp1, word[tbl+offset+tmp1*2]); break;
+          default: mov(Xbyak::Reg32(tmp1.getIdx()), dword[tbl+offset+tmp1*4]); break;
+        }
+        JumpState(tbl, tmp1, tmp1);
+        L(".single");
+        outLocalLabel();
+      }
       cmp(arg1, arg2);
       je("@f");
       movzx(tmp1, byte[arg1]);
       add(arg1, sign);
-      jmp(ptr[tbl+i*256*sizeof(uint8_t*)+tmp1*sizeof(uint8_t*)]);
+      if (use_alphabet) movzx(tmp1, byte[tbl+tmp1]);
+      switch (width) {
+        case 1: movzx(tmp1, byte[tbl+table_offset+i*alphabet_size+tmp1]); break;
+        case 2: movzx(tmp1, word[tbl+table_offset+i*alphabet_size*2+tmp1*2]); break;
+        default: mov(Xbyak::Reg32(tmp1.getIdx()), dword[tbl+table_offset+i*alphabet_size*4+tmp1*4]); break;
+      }
+      JumpState(tbl, tmp1, tmp1);
       L("@@");
       mov(reg_a, i);
       jmp("return");
@@ -758,17 +1531,65 @@ JITCompiler::JITCompiler(const DFA &dfa, std::size_t state_code_size = 64):
     align(16);
   }
 
-  // backpatching (each states address)
+  // backpatching (byte class map, filter map, keyword, address table and transitions)
+  for (std::size_t c = 0; c < 256; c++) {
+    alphabet_ptr[c] = dfa.alphabet()[c];
+    filter_ptr[c] = dfa.expr_info().involve[c];
+  }
+  if (!keyword.empty()) {
+    uint8_t *keyword_ptr = alphabet_ptr + keyword_offset;
+    std::copy(keyword.begin(), keyword.end(), keyword_ptr);
+    std::fill(keyword_ptr+16, keyword_ptr+32, keyword[0]);
+    std::fill(keyword_ptr+32, keyword_ptr+48, keyword[keyword.size()-1]);
+  }
+  for (std::size_t i = 0; i < skip_exits_table.size(); i++) {
+    uint8_t *skip_ptr = alphabet_ptr + skip_table_offset + i * skip_exits * 16;
+    for (std::size_t j = 0; j < skip_exits; j++) {
+      // unused vectors repeat the first exit byte.
+      const std::vector<unsigned char> &e = skip_exits_table[i];
+      std::fill(skip_ptr+j*16, skip_ptr+j*16+16, e[j < e.size() ? j : 0]);
+    }
+  }
+  const std::size_t reject = dfa.size(), filter = dfa.size() + 1;
+  for (std::size_t i = 0; i < dfa.size(); i++) {
+    address_table_ptr[i] = states_addr_[i] - alphabet_ptr;
+  }
+  address_table_ptr[reject] = reject_state_addr - alphabet_ptr;
+  address_table_ptr[filter] = filter_entry_ != NULL ? filter_entry_ - alphabet_ptr : 0;
   for (std::size_t i = 0; i < dfa.size(); i++) {
     const DFA::Transition &trans = dfa.GetTransition(i);
-    for (int c = 0; c < 256; c++) {
-      DFA::state_t next = trans[c];
+    for (std::size_t c = 0; c < alphabet_size; c++) {
+      DFA::state_t next = trans.at(c);
+      std::size_t index = i*alphabet_size+c;
       if (next == DFA::REJECT) {
-        transition_table_ptr[i*256+c] = reject_state_addr;
+        next = reject;
       } else if (filter_entry_ != NULL && next == reset_state_) {
-        transition_table_ptr[i*256+c] = filter_entry_;
-      } else {
-        transition_table_ptr[i*256+c] = states_addr_[next];
+        next = filter;
+      }
+      switch (width) {
+        case 1: transition_table_ptr[index] = next; break;
+        case 2: ((uint16_t*)transition_table_ptr)[index] = next; break;
+        default: ((uint32_t*)transition_table_ptr)[index] = next; break;
+      }
+    }
+  }
+  for (std::size_t i = 0; dfa.HasStrideTable() && i < dfa.size(); i++) {
+    const DFA::Transition &trans = dfa.GetTransition(i);
+    for (std::size_t c1 = 0; c1 < alphabet_size; c1++) {
+      const DFA::state_t mid = trans.at(c1);
+      for (std::size_t c2 = 0; c2 < alphabet_size; c2++) {
+        DFA::state_t next = mid == DFA::REJECT ? DFA::REJECT : dfa.GetTransition(mid).at(c2);
+        std::size_t index = (i*alphabet_size+c1)*alphabet_size+c2;
+        if (next == DFA::REJECT) {
+          next = reject;
+        } else if (filter_entry_ != NULL && next == reset_state_) {
+          next = filter;
+        }
+        switch (width) {
+          case 1: stride_table_ptr[index] = next; break;
+          case 2: ((uint16_t*)stride_table_ptr)[index] = next; break;
+          default: ((uint32_t*)stride_table_ptr)[index] = next; break;
+        }
       }
     }
   }
@@ -841,7 +1662,13 @@ bool DFA::Reduce()
 
 bool DFA::Compile(Regen::Options::CompileFlag olevel)
 {
-  if (!complete_) return false;
+  if (!complete_ && image_ == NULL && olevel >= Regen::Options::O1) {
+    // states of the on-the-fly DFA are JIT-ed when they are reached.
+    if (jitter_ == NULL) jitter_ = new Jitter(*this, accept_.capacity());
+    olevel_ = Regen::Options::O1;
+    return olevel == olevel_;
+  }
+  if (!complete_ || image_ != NULL) return false;
   if (olevel <= olevel_) return true;
   if (olevel >= Regen::Options::O2) {
     if (EliminateBranch()) {
@@ -851,59 +1678,371 @@ bool DFA::Compile(Regen::Options::CompileFlag olevel)
       olevel_ = Regen::Options::O3;
     }
   }
-  xgen_ = new JITCompiler(*this);
-  CompiledMatch = (state_t (*)(const unsigned char**, const unsigned char**, state_t))xgen_->getCode();
   if (olevel_ < Regen::Options::O1) olevel_ = Regen::Options::O1;
+  delete xgen_;
+  xgen_ = NULL;
+  delete xcount_;
+  xcount_ = NULL;
+  if (code_ != NULL) munmap(code_, code_size_);
+  code_ = NULL;
+  std::string cache;
+  if (!flag_.jit_cache().empty()) {
+    char key[32];
+    snprintf(key, sizeof(key), "/%016llx.jit", (unsigned long long)CodeCacheKey());
+    cache = flag_.jit_cache() + key;
+  }
+  if (!cache.empty() && LoadCode(cache)) {
+    CompiledMatch = (state_t (*)(const unsigned char**, const unsigned char**, state_t))code_;
+  } else {
+    xgen_ = new JITCompiler(*this);
+    CompiledMatch = (state_t (*)(const unsigned char**, const unsigned char**, state_t))xgen_->getCode();
+    if (!cache.empty()) SaveCode(cache);
+  }
   return olevel == olevel_;
 }
+
+DFA::~DFA()
+{
+  delete xgen_;
+  delete xcount_;
+  delete jitter_;
+  if (code_ != NULL) munmap(code_, code_size_);
+}
+
+/* the generated code depends on the tables, the options, olevel and
+   the cpu (not on the pattern itself, e.g. minimized DFA differs). */
+uint64_t DFA::CodeCacheKey() const
+{
+  uint64_t hash = 14695981039346656037ULL;
+  std::string key;
+  uint64_t header[11] = {3, sizeof(void*)}; // format version, word size.
+  header[2] = olevel_;
+  header[3] = flag_.parse_flag();
+  header[4] = flag_.delimiter();
+  header[5] = size();
+  header[6] = alphabet_.size;
+  header[7] = expr_info_.min_length;
+  header[9] = HasStrideTable();
+  header[10] = expr_info_.max_length; // an immediate of the keyword filter.
+  Xbyak::util::Cpu cpu;
+  for (std::size_t i = 0; i < 32; i++) {
+    if (cpu.has(static_cast<Xbyak::util::Cpu::Type>(1U << i))) header[8] |= 1U << i;
+  }
+  key.append((const char*)header, sizeof(header));
+  key.append((const char*)alphabet_.map, sizeof(alphabet_.map));
+  key.append((const char*)&transition_[0], size() * alphabet_.size * sizeof(state_t));
+  key.append((const char*)&accept_[0], size());
+  for (std::size_t c = 0; c < 256; c++) key += (char)expr_info_.involve[c];
+  key += expr_info_.key.longest_keyword();
+  for (std::size_t i = 0; i < key.size(); i++) {
+    hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+/* cache file: header page, followed by the code and the data segment
+   (position independent, it is mapped as is). */
+namespace {
+struct CodeHeader {
+  char magic[8];
+  uint64_t key;
+  uint64_t size;
+};
+const char code_magic[8] = {'R', 'E', 'G', 'E', 'N', 'J', 'I', 'T'};
+const std::size_t code_header_size = 4096;
+} // namespace
+
+bool DFA::LoadCode(const std::string &path)
+{
+#ifdef _WIN32
+  return false;
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  CodeHeader header;
+  struct stat st;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+      || fstat(fd, &st) != 0
+      || memcmp(header.magic, code_magic, sizeof(header.magic)) != 0
+      || header.key != CodeCacheKey()
+      || (uint64_t)st.st_size != code_header_size + header.size) {
+    close(fd);
+    return false;
+  }
+  void *code = mmap(NULL, header.size, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, code_header_size);
+  close(fd);
+  if (code == MAP_FAILED) return false;
+  code_ = code;
+  code_size_ = header.size;
+  return true;
+#endif
+}
+
+bool DFA::SaveCode(const std::string &path) const
+{
+#ifdef _WIN32
+  return false;
+#else
+  const uint8_t *code = xgen_->getCode();
+  CodeHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, code_magic, sizeof(header.magic));
+  header.key = CodeCacheKey();
+  header.size = xgen_->CodeSize();
+
+  std::string image(code_header_size, 0);
+  memcpy(&image[0], &header, sizeof(header));
+  image.append((const char*)code, header.size);
+
+  // written aside and renamed, concurrent writers (and readers) are safe.
+  char tmp[32];
+  snprintf(tmp, sizeof(tmp), ".%d", (int)getpid());
+  const std::string tmppath = path + tmp;
+  FILE *fp = fopen(tmppath.c_str(), "wb");
+  if (fp == NULL) return false;
+  bool written = fwrite(image.data(), 1, image.size(), fp) == image.size();
+  written &= fclose(fp) == 0;
+  if (!written || rename(tmppath.c_str(), path.c_str()) != 0) {
+    remove(tmppath.c_str());
+    return false;
+  }
+  return true;
+#endif
+}
 #else
 bool DFA::EliminateBranch() { return false; }
 bool DFA::Reduce() { return false; }
 bool DFA::Compile(Regen::Options::CompileFlag) { return false; }
+DFA::~DFA() {}
 #endif
 
 bool DFA::Match(const Regen::StringPiece &string, Regen::StringPiece *result) const
 {
   if (!complete_) return OnTheFlyMatch(string, result);
 
-  Regen::StringPiece string_(string);
-  int sign = 1;
   const unsigned char* matchptr = NULL;
-  if (flag_.reverse_match()) {
-    sign = -1;
-    string_.reverse();
-  }
   state_t state = 0;
-  bool accept = false;
+  bool accept = false, consumed;
 
   if (olevel_ >= Regen::Options::O1) {
     /* JITed matching */
+    Regen::StringPiece string_(string);
+    if (flag_.reverse_match()) string_.reverse();
     const unsigned char **arg1 = string_._udata();
     state = CompiledMatch(arg1, &matchptr, state);
+    consumed = string_.empty();
+  } else {
+    int dir = 1;
+    const unsigned char* str = string.ubegin();
+    const unsigned char* end = string.uend();
+    if (flag_.reverse_match()) {
+      dir = -1; str--, end--;
+      std::swap(str, end);
+    }
+    const unsigned char **m = result == NULL && flag_.suffix_match() ? NULL : &matchptr;
+    switch (table_width_) {
+      case 1: state = TableMatch(static_cast<const uint8_t*>(match_table_), static_cast<const uint8_t*>(match_stride_), &str, end, dir, m); break;
+      case 2: state = TableMatch(static_cast<const uint16_t*>(match_table_), static_cast<const uint16_t*>(match_stride_), &str, end, dir, m); break;
+      default: state = TableMatch(static_cast<const state_t*>(match_table_), static_cast<const state_t*>(match_stride_), &str, end, dir, m); break;
+    }
+    consumed = str == end;
+  }
+
+  if (state != REJECT) {
+    accept = match_accept_[state];
+    if (!accept && consumed) accept = match_eol_[state] & (string.empty() ? 2 : 1);
+  }
+  return SetResult(string, accept, matchptr, result);
+}
+
+std::size_t DFA::Count(const Regen::StringPiece &string) const
+{
+  std::size_t count = 0;
+  // the delimiter of the last line starts no line.
+  Regen::StringPiece lines(string);
+  if (!lines.empty() && lines.end()[-1] == flag_.delimiter()) lines.set_end(lines.end() - 1);
+#ifdef REGEN_ENABLE_JIT
+  if (complete_ && olevel_ >= Regen::Options::O1 && image_ == NULL
+      && flag_.shortest_match() && !flag_.suffix_match() && !flag_.reverse_match()) {
+    // one call of the JITed counting loop for the whole string.
+    state_lock_.lock();
+    if (xcount_ == NULL) xcount_ = new JITCompiler(*this, 64, true);
+    state_lock_.unlock();
+    state_t (*CompiledCount)(const unsigned char**, std::size_t*, state_t)
+        = (state_t (*)(const unsigned char**, std::size_t*, state_t))xcount_->getCode();
+    Regen::StringPiece string_(lines);
+    state_t state = CompiledCount(string_._udata(), &count, 0);
+    if (state == UNDEF) { // the last line is empty.
+      if ((match_eol_[0] & 2) != 0) count++;
+    } else if (state != REJECT && (match_eol_[state] & (lines.empty() ? 2 : 1)) != 0) {
+      count++;
+    }
+    return count;
+  }
+#endif
+  Regen::StringPiece string_(lines), result;
+  while (Match(string_, &result)) {
+    count++;
+    if (result.end() == NULL) break; // accepted at the end.
+    // a match may end with its delimiter ($), the next line follows it.
+    const char *end = result.end() != string_.begin() && result.end()[-1] == flag_.delimiter() ? result.end() - 1
+        : static_cast<const char*>(memchr(result.end(), flag_.delimiter(), string_.end() - result.end()));
+    if (end == NULL) break;
+    string_.set_begin(end + 1);
+  }
+  return count;
+}
+
+void DFA::MatchMany(const Regen::StringPiece *strings, std::size_t n, bool *results) const
+{
+  if (complete_ && !flag_.reverse_match()) {
+    switch (table_width_) {
+      case 1: LockstepMatch(static_cast<const uint8_t*>(match_table_), strings, n, results); break;
+      case 2: LockstepMatch(static_cast<const uint16_t*>(match_table_), strings, n, results); break;
+      default: LockstepMatch(static_cast<const state_t*>(match_table_), strings, n, results); break;
+    }
+    return;
+  }
+  Regen::StringPiece result;
+  for (std::size_t i = 0; i < n; i++) {
+    results[i] = Match(strings[i], flag_.suffix_match() ? NULL : &result);
+  }
+}
+
+/* two bytes per lookup with the stride table (if any), the rest (and
+   a reject within two bytes) is done byte by byte. */
+template<class T>
+DFA::state_t DFA::TableMatch(const T *table, const T *stride, const unsigned char **str_, const unsigned char *end,
+                             int dir, const unsigned char **matchptr) const
+{
+  const T reject = static_cast<T>(REJECT);
+  const std::size_t k = alphabet_.size;
+  const unsigned char *str = *str_;
+  T state = 0, next;
+  if (matchptr == NULL) {
+    if (stride != NULL) {
+      while ((end - str) * dir >= 2
+             && (next = stride[(state*k+alphabet_[str[0]])*k+alphabet_[str[dir]]]) != reject) {
+        state = next;
+        str += 2 * dir;
+      }
+    }
+    while (str != end && (next = table[state*k+alphabet_[*str]]) != reject) {
+      state = next;
+      str += dir;
+    }
   } else {
-    if (result == NULL) {
-      while (!string_.empty() && (state = transition_[state][*string_.udata()]) != DFA::REJECT) {
-        string_.consume(sign);
+    if (match_accept_[state]) *matchptr = str;
+    if (stride != NULL) {
+      while ((end - str) * dir >= 2) {
+        const std::size_t c = state*k+alphabet_[str[0]];
+        if ((next = stride[c*k+alphabet_[str[dir]]]) == reject) break;
+        // acceptance at the intermediate byte.
+        if (match_accept_[table[c]]) *matchptr = str + dir;
+        state = next;
+        str += 2 * dir;
+        if (match_accept_[state]) *matchptr = str;
       }
+    }
+    while (str != end && (next = table[state*k+alphabet_[*str]]) != reject) {
+      state = next;
+      str += dir;
+      if (match_accept_[state]) *matchptr = str;
+    }
+  }
+  *str_ = str;
+  return str != end ? REJECT : state;
+}
+
+/* a few strings (lanes) run in lockstep until one of them is decided
+   (rejected, accepted or consumed), the decided lane takes the next
+   string of the batch. the lanes' table loads are independent, so
+   their latencies overlap. */
+template<class T>
+void DFA::LockstepMatch(const T *table, const Regen::StringPiece *strings, std::size_t n, bool *results) const
+{
+  enum { lanes = 4 };
+  const T reject = static_cast<T>(REJECT);
+  const std::size_t k = alphabet_.size;
+  // without suffix matching, the first acceptance decides the string.
+  const bool early = !flag_.suffix_match();
+  const unsigned char *str[lanes], *end[lanes];
+  std::size_t index[lanes];
+  T state[lanes];
+  std::size_t next = 0;
+  for (std::size_t l = 0; l < lanes; l++) index[l] = n;
+
+  for (;;) {
+    std::size_t steps = std::numeric_limits<std::size_t>::max(), busy = 0;
+    for (std::size_t l = 0; l < lanes; l++) {
+      for (;;) {
+        if (index[l] != n) {
+          bool decided = true, accept;
+          if (state[l] == reject) {
+            accept = false;
+          } else if (early && match_accept_[state[l]]) {
+            accept = true;
+          } else if (str[l] == end[l]) {
+            const bool empty = strings[index[l]].empty();
+            accept = match_accept_[state[l]] || (match_eol_[state[l]] & (empty ? 2 : 1)) != 0;
+          } else {
+            decided = false;
+          }
+          if (!decided) break;
+          results[index[l]] = accept;
+          index[l] = n;
+        }
+        if (next == n) break;
+        index[l] = next;
+        str[l] = strings[next].ubegin();
+        end[l] = strings[next].uend();
+        state[l] = 0;
+        next++;
+      }
+      if (index[l] != n) {
+        steps = std::min<std::size_t>(steps, end[l] - str[l]);
+        busy++;
+      }
+    }
+    if (busy == 0) break;
+    // no lane reaches its end within the steps.
+    if (busy == lanes) {
+      // the lanes are unrolled (in registers).
+      T s0 = state[0], s1 = state[1], s2 = state[2], s3 = state[3];
+      const unsigned char *p0 = str[0], *p1 = str[1], *p2 = str[2], *p3 = str[3];
+      for (; steps > 0; steps--) {
+        s0 = table[s0*k+alphabet_[*p0++]];
+        s1 = table[s1*k+alphabet_[*p1++]];
+        s2 = table[s2*k+alphabet_[*p2++]];
+        s3 = table[s3*k+alphabet_[*p3++]];
+        if ((s0 == reject) | (s1 == reject) | (s2 == reject) | (s3 == reject)) break;
+        if (early && (match_accept_[s0] | match_accept_[s1] | match_accept_[s2] | match_accept_[s3])) break;
+      }
+      state[0] = s0, state[1] = s1, state[2] = s2, state[3] = s3;
+      str[0] = p0, str[1] = p1, str[2] = p2, str[3] = p3;
     } else {
-      if (IsAcceptState(state)) matchptr = string_.udata();
-      while (!string_.empty() && (state = transition_[state][*string_.udata()]) != DFA::REJECT) {
-        if (IsAcceptState(state)) matchptr = string_.udata();
-        string_.consume(sign);
+      for (; steps > 0; steps--) {
+        bool decided = false;
+        for (std::size_t l = 0; l < lanes; l++) {
+          if (index[l] == n) continue;
+          state[l] = table[state[l]*k+alphabet_[*str[l]++]];
+          decided |= state[l] == reject || (early && match_accept_[state[l]]);
+        }
+        if (decided) break;
       }
     }
   }
+}
 
-  accept = IsAcceptState(state);
-  if (!accept && state != REJECT && string_.empty()) {
-    Subset endstates = nfa_map_[state];
-    ExpandStates(&endstates, string.empty(), true);
-    accept = ContainAcceptState(endstates);
-  }
+bool DFA::SetResult(const Regen::StringPiece &string, bool accept, const unsigned char *matchptr, Regen::StringPiece *result) const
+{
   if (result == NULL) {
-    return accept;
+    // a partial match may end before the string does.
+    return accept || (!flag_.suffix_match() && matchptr != NULL);
   } else {
-    if (flag_.suffix_match() && accept) {
+    if (flag_.suffix_match()) {
+      // the whole string must be accepted, not a prefix of it.
+      if (!accept) return false;
       if (flag_.reverse_match()) {
         result->set_begin(string.begin());
       } else {
@@ -923,16 +2062,117 @@ bool DFA::Match(const Regen::StringPiece &string, Regen::StringPiece *result) co
   }
 }
 
+void DFA::NextStates(const Subset &states, unsigned char c, Subset *next) const
+{
+  next->clear();
+  // Leftmost-Shortest matching: accepted states have no transitions.
+  if (!flag_.suffix_match() && flag_.shortest_match() && ContainAcceptState(states)) return;
+
+  bool delimiter = c == flag_.delimiter() && !flag_.one_line();
+  for (Subset::const_iterator iter = states.begin(); iter != states.end(); ++iter) {
+    StateExpr *state = *iter;
+    if (state->non_greedy()) MakeNonGreedy(state);
+    bool match = false;
+    switch (state->type()) {
+      case Expr::kLiteral:
+        match = !delimiter && static_cast<Literal*>(state)->literal() == c;
+        break;
+      case Expr::kCharClass:
+        match = !delimiter && state->Match(c);
+        break;
+      case Expr::kDot:
+        match = !delimiter || static_cast<Dot*>(state)->match_delimiter();
+        break;
+      case Expr::kAnchor:
+        match = delimiter;
+        break;
+      default: break;
+    }
+    if (match) next->insert(state->follow().begin(), state->follow().end());
+  }
+  ExpandStates(next);
+  if (ContainAcceptState(*next)) TrimNonGreedy(next);
+}
+
+DFA::state_t DFA::LazyState(const Subset &states) const
+{
+  if (states.empty()) return REJECT;
+  state_t state = subsets_.Find(states);
+  if (state == UNDEF) {
+    State &s = get_new_state();
+    s.accept = ContainAcceptState(states);
+    accept_.push_back(s.accept);
+    subsets_.Insert(states, s.id);
+    state = s.id;
+  }
+  return state;
+}
+
+std::size_t DFA::CacheMemory() const
+{
+  std::size_t memory = transition_.size() * sizeof(state_t) + states_.size() * sizeof(State)
+      + subsets_.memory();
+#ifdef REGEN_ENABLE_JIT
+  if (jitter_ != NULL) memory += jitter_->memory();
+#endif
+  return memory;
+}
+
+bool DFA::CacheFull() const
+{
+  // tables never grow beyond their reserved capacity: concurrent readers
+  // access them without locks.
+  return CacheMemory() > cache_budget_
+      || transition_.size() + alphabet_.size > transition_.capacity()
+      || accept_.size() == accept_.capacity();
+}
+
+void DFA::ReserveCache() const
+{
+  const std::size_t row = alphabet_.size * sizeof(state_t);
+  // the states kept, the cache_size budget (the start, the surviving state
+  // and its next one at least).
+  const std::size_t rows = size() + std::min<std::size_t>(flag_.cache_size(), 1 << 28) / row + 3;
+  transition_.reserve(rows * alphabet_.size);
+  accept_.reserve(rows);
+}
+
+DFA::state_t DFA::FlushCache(const Subset &states) const
+{
+  transition_.clear();
+  states_.clear();
+  subsets_.clear();
+  accept_.clear();
+  cache_generation_++;
+  cache_budget_ = flag_.cache_size();
+  ReserveCache();
+#ifdef REGEN_ENABLE_JIT
+  if (jitter_ != NULL) jitter_->Reset(accept_.capacity());
+#endif
+
+  Subset start = expr_info_.expr_root->first();
+  ExpandStates(&start, true);
+  if (ContainAcceptState(start)) TrimNonGreedy(&start);
+  LazyState(start);
+  // the current state survives the flush (with a new id).
+  return states.empty() ? 0 : LazyState(states);
+}
+
+/* On-the-fly DFA, shared by concurrent matchers.
+ * readers look transitions up without locks (acquire loads), new states are
+ * added under state_lock_ and published by a release store of the transition.
+ * cache_lock_ is held shared while matching, and exclusive to flush. */
 bool DFA::OnTheFlyMatch(const Regen::StringPiece& string, Regen::StringPiece* result) const
 {
-  if (empty()) {
-    Subset states = expr_info_.expr_root->first();
-    ExpandStates(&states, true);
-    bool accept = ContainAcceptState(states);
-    State& s = get_new_state();
-    dfa_map_[states] = s.id;
-    nfa_map_[s.id] = states;
-    s.accept = accept;
+  cache_lock_.lock_shared();
+  if (cache_generation_ == 0) {
+    cache_lock_.unlock_shared();
+    cache_lock_.lock();
+    if (cache_generation_ == 0) {
+      FillAlphabet();
+      FlushCache(Subset());
+    }
+    cache_lock_.unlock_and_lock_shared();
   }
 
   int dir = 1;  
@@ -942,52 +2182,386 @@ bool DFA::OnTheFlyMatch(const Regen::StringPiece& string, Regen::StringPiece* re
     dir = -1; str--, end--;
     std::swap(str, end);
   }
-  
+
   state_t state = 0, next = UNDEF;
-  
+  const unsigned char *matchptr = NULL, *flushptr = NULL;
+  bool fallback = false;
+  Subset states, nexts;
+  if (accept_[state]) matchptr = str;
+
   while (str != end) {
-    next = transition_[state][*str];
-    if (next >= UNDEF) {
-      if (next == REJECT) return false;
-      do { // do matching with on-the-fly construction.
-        Subset& states = nfa_map_[state];
-        Subset nexts;
-
-        for (Subset::iterator iter = states.begin(); iter != states.end(); ++iter) {
-          if ((*iter)->Match(*str)) {
-            nexts.insert((*iter)->follow().begin(), (*iter)->follow().end());
-          }
+#ifdef REGEN_ENABLE_JIT
+    if (jitter_ != NULL) {
+      // run the native code of states, up to a missing transition.
+      const void *code = jitter_->Lookup(state);
+      if (code == NULL) {
+        state_lock_.lock();
+        code = jitter_->Code(state);
+        state_lock_.unlock();
+      }
+      if ((state = jitter_->Match(code, &str, end, &matchptr)) == REJECT) {
+        next = REJECT;
+        break;
+      }
+      if (str == end) break;
+    }
+#endif
+    next = Util::load_acquire(&trans(state, *str));
+    if (next == UNDEF) {
+      state_lock_.lock();
+      while ((next = trans(state, *str)) == UNDEF) {
+        subsets_.Get(state, &states);
+        if (!CacheFull()) {
+          NextStates(states, *str, &nexts);
+          next = LazyState(nexts);
+          Util::store_release(&trans(state, *str), next);
+          break;
         }
-        ExpandStates(&nexts);
-
-        if (nexts.empty()) {
-          next = transition_[state][*str] = REJECT;
-        } else if (dfa_map_.find(nexts) == dfa_map_.end()) {
-          bool accept = ContainAcceptState(nexts);
-          State& s = get_new_state();
-          dfa_map_[nexts] = s.id;
-          nfa_map_[s.id] = nexts;
-          s.accept = accept;
-          next = transition_[state][*str] = s.id;
-        } else {
-          next = dfa_map_[nexts];
+        // thrashing: less than 10 bytes were scanned per state since the last flush.
+        if (flushptr != NULL && (std::size_t)((str - flushptr) * dir) < 10 * size()) {
+          nfa_fallbacks_++;
+          fallback = true;
+          break;
         }
-        str += dir;
-        state = next;
-      } while (str != end && transition_[state][*str] == UNDEF);
-    } else {
+        state_lock_.unlock();
+        std::size_t generation = cache_generation_;
+        cache_lock_.unlock_shared();
+        cache_lock_.lock();
+        if (generation == cache_generation_) {
+          FlushCache(states);
+          cache_flushes_++;
+        }
+        state = LazyState(states);
+        cache_lock_.unlock_and_lock_shared();
+        flushptr = str;
+        state_lock_.lock();
+      }
+      state_lock_.unlock();
+      if (fallback) break;
+    }
+#ifdef REGEN_ENABLE_JIT
+    if (jitter_ != NULL) {
+      state_lock_.lock();
+      jitter_->Patch(state, *str, next);
+      state_lock_.unlock();
+    }
+#endif
+    if (next == REJECT) break;
+    str += dir;
+    state = next;
+    if (accept_[state]) matchptr = str;
+  }
+
+  bool accept = false;
+  if (!fallback) {
+    states.clear();
+    if (str == end && next != REJECT && !(accept = accept_[state])) {
+      state_lock_.lock();
+      subsets_.Get(state, &states);
+      state_lock_.unlock();
+    }
+  }
+  cache_lock_.unlock_shared();
+
+  if (fallback) {
+    // fall back to the (uncached) simulation of position sets,
+    // MakeNonGreedy may still modify positions, hence the lock.
+    while (str != end && !states.empty()) {
+      state_lock_.lock();
+      NextStates(states, *str, &nexts);
+      state_lock_.unlock();
+      states.swap(nexts);
       str += dir;
-      state = next;
+      if (ContainAcceptState(states)) matchptr = str;
     }
+    accept = str == end && ContainAcceptState(states);
+  }
+  if (!accept && str == end && !states.empty()) {
+    ExpandStates(&states, string.empty(), true);
+    accept = ContainAcceptState(states);
   }
+  return SetResult(string, accept, matchptr, result);
+}
 
-  if (IsAcceptState(state)) return true;
-  if (str == end && state != REJECT) {
-    Subset endstates = nfa_map_[state];
-    ExpandStates(&endstates, str == string.ubegin(), true);
-    return ContainAcceptState(endstates);
+DFA::state_t DFA::SOMLazyState(const SOMGroups &groups) const
+{
+  std::map<SOMGroups, state_t>::iterator iter = som_index_.find(groups);
+  if (iter != som_index_.end()) return iter->second;
+  state_t state = som_groups_.size();
+  iter = som_index_.insert(std::make_pair(groups, state)).first;
+  som_groups_.push_back(&iter->first);
+  int32_t accept = -1;
+  for (std::size_t i = 1; i < groups.first.size(); i++) {
+    if (ContainAcceptState(groups.first[i])) {
+      accept = i - 1;
+      break;
+    }
   }
-  return false;
+  som_accept_.push_back(accept);
+  som_exit_.push_back(UNDEF);
+  som_map_.resize(som_map_.size() + alphabet_.size, 0);
+  som_next_.resize(som_next_.size() + alphabet_.size, UNDEF);
+  return state;
+}
+
+void DFA::SOMFlushCache() const
+{
+  som_index_.clear();
+  som_groups_.clear();
+  som_accept_.clear();
+  som_exit_.clear();
+  som_next_.clear();
+  som_map_.clear();
+  som_map_index_.clear();
+  som_maps_.clear();
+  som_generation_++;
+  // tables never grow beyond their reserved capacity (lock free readers).
+  const std::size_t row = alphabet_.size * (sizeof(state_t) + sizeof(uint32_t))
+      + sizeof(const SOMGroups*) + sizeof(int32_t) + sizeof(int) + sizeof(std::vector<uint32_t>);
+  const std::size_t rows = std::min<std::size_t>(flag_.cache_size(), 1 << 28) / row + 2;
+  som_groups_.reserve(rows);
+  som_accept_.reserve(rows);
+  som_exit_.reserve(rows);
+  som_next_.reserve(rows * alphabet_.size);
+  som_map_.reserve(rows * alphabet_.size);
+  som_maps_.reserve(rows);
+  som_maps_.push_back(std::vector<uint32_t>());
+
+  // the start state: one (fresh) group which starts at the beginning.
+  Subset start = expr_info_.expr_root->first();
+  ExpandStates(&start, true);
+  if (ContainAcceptState(start)) TrimNonGreedy(&start);
+  SOMGroups groups(std::vector<Subset>(1), true);
+  if (start.erase(expr_info_.prefix)) groups.first[0].insert(expr_info_.prefix);
+  if (!start.empty()) groups.first.push_back(start);
+  else groups.second = false;
+  SOMLazyState(groups);
+}
+
+bool DFA::SOMCacheFull() const
+{
+  return som_groups_.size() * alphabet_.size * (sizeof(state_t) + sizeof(uint32_t)) > flag_.cache_size()
+      || som_groups_.size() == som_groups_.capacity()
+      || som_maps_.size() == som_maps_.capacity();
+}
+
+/* the groups move as the subset of positions does (NextStates is
+   distributive), a position reached by several groups is kept by the
+   oldest one, the prefix spawns a (fresh) group by each byte.
+   the cache must not be full, the transition is published last. */
+DFA::state_t DFA::SOMNextState(state_t state, std::size_t klass) const
+{
+  const unsigned char c = alphabet_.rep[klass];
+  const std::vector<Subset> &groups = som_groups_[state]->first;
+  // starts of groups are kept for not fresh groups only.
+  const std::size_t fresh = som_groups_[state]->second ? groups.size() - 1 : groups.size();
+  SOMGroups next(std::vector<Subset>(1), false);
+  std::vector<uint32_t> map;
+  state_t nextid = REJECT;
+  if (!(!flag_.suffix_match() && flag_.shortest_match() && som_accept_[state] >= 0)) {
+    Subset nexts;
+    bool accept = false;
+    for (std::size_t i = 1; i < groups.size(); i++) {
+      NextStates(groups[i], c, &nexts);
+      if (nexts.empty()) continue;
+      accept |= ContainAcceptState(nexts);
+      next.first.push_back(nexts);
+      map.push_back(i == fresh ? UNDEF : i - 1);
+    }
+    NextStates(groups[0], c, &nexts);
+    if (nexts.erase(expr_info_.prefix)) next.first[0].insert(expr_info_.prefix);
+    if (!nexts.empty()) {
+      accept |= ContainAcceptState(nexts);
+      next.first.push_back(nexts);
+      next.second = true;
+    }
+    if (accept) {
+      for (std::size_t i = 0; i < next.first.size(); i++) TrimNonGreedy(&next.first[i]);
+    }
+    Subset seen;
+    std::size_t n = 1;
+    for (std::size_t i = 1; i < next.first.size(); i++) {
+      Subset group;
+      std::set_difference(next.first[i].begin(), next.first[i].end(), seen.begin(), seen.end(),
+                          std::inserter(group, group.end()));
+      if (group.empty()) {
+        if (i == next.first.size() - 1) next.second = false;
+        continue;
+      }
+      seen.insert(group.begin(), group.end());
+      next.first[n].swap(group);
+      if (i - 1 < map.size()) map[n-1] = map[i-1];
+      n++;
+    }
+    next.first.resize(n);
+    map.resize(next.second ? n-2 : n-1);
+    if (n > 1 || !next.first[0].empty()) nextid = SOMLazyState(next);
+  }
+
+  bool identity = nextid != REJECT && map.size() == fresh - 1;
+  for (std::size_t i = 0; identity && i < map.size(); i++) identity = map[i] == i;
+  uint32_t mapid = 0;
+  if (!identity) {
+    std::map<std::vector<uint32_t>, uint32_t>::iterator iter = som_map_index_.find(map);
+    if (iter == som_map_index_.end()) {
+      iter = som_map_index_.insert(std::make_pair(map, (uint32_t)som_maps_.size())).first;
+      som_maps_.push_back(map);
+    }
+    mapid = iter->second;
+  }
+  som_map_[state*alphabet_.size+klass] = mapid;
+  Util::store_release(&som_next_[state*alphabet_.size+klass], nextid);
+  return nextid;
+}
+
+/* a state without starts (no thread started before the current byte)
+   loops on itself until a thread starts, if one byte only can start a
+   thread (a class of one byte), the loop is skipped by memchr. */
+int DFA::SOMExitByte(state_t state) const
+{
+  const std::size_t k = alphabet_.size;
+  const SOMGroups &groups = *som_groups_[state];
+  int byte = -1;
+  if (som_accept_[state] < 0 && groups.first.size() - groups.second == 1) {
+    std::size_t exit = k;
+    for (std::size_t klass = 0; klass < k; klass++) {
+      state_t next = som_next_[state*k+klass];
+      if (next == UNDEF) {
+        // (not worth a flush of the cache)
+        if (SOMCacheFull()) {
+          exit = k;
+          break;
+        }
+        next = SOMNextState(state, klass);
+      }
+      if (next == state && som_map_[state*k+klass] == 0) continue;
+      if (exit != k) {
+        exit = k;
+        break;
+      }
+      exit = klass;
+    }
+    for (std::size_t c = 0; exit != k && c < 256; c++) {
+      if (alphabet_[c] != exit) continue;
+      if (byte != -1) {
+        byte = -1;
+        break;
+      }
+      byte = c;
+    }
+  }
+  Util::store_release(&som_exit_[state], byte);
+  return byte;
+}
+
+/* Start of match tracking by a DFA of thread groups (built on the fly),
+ * each group carries the start of its threads, the start of a match is
+ * the one of the oldest accepting group, that is the leftmost start of
+ * the match (as the reverse scan from its end would find).
+ * matchers share the states like the on-the-fly DFA's (see OnTheFlyMatch). */
+bool DFA::SOMMatch(const Regen::StringPiece& string, Regen::StringPiece* result) const
+{
+  som_cache_lock_.lock_shared();
+  if (som_generation_ == 0) {
+    som_cache_lock_.unlock_shared();
+    som_cache_lock_.lock();
+    if (som_generation_ == 0) {
+      if (!complete_) {
+        // the alphabet of the on-the-fly DFA is filled by its first flush.
+        cache_lock_.lock();
+        if (cache_generation_ == 0) {
+          FillAlphabet();
+          FlushCache(Subset());
+        }
+        cache_lock_.unlock();
+      }
+      state_lock_.lock();
+      SOMFlushCache();
+      state_lock_.unlock();
+    }
+    som_cache_lock_.unlock_and_lock_shared();
+  }
+
+  const std::size_t k = alphabet_.size;
+  const unsigned char* str = string.ubegin();
+  const unsigned char* end = string.uend();
+  const unsigned char *matchptr = NULL, *start = NULL;
+  std::vector<const unsigned char *> starts, starts_;
+  state_t state = 0, next = UNDEF;
+  int32_t accept_group;
+
+  if (som_accept_[state] >= 0) matchptr = start = str;
+
+  while (str != end) {
+    int byte = Util::load_acquire(&som_exit_[state]);
+    if (byte == (int)UNDEF) {
+      state_lock_.lock();
+      byte = SOMExitByte(state);
+      state_lock_.unlock();
+    }
+    if (byte >= 0) {
+      const unsigned char *p = static_cast<const unsigned char*>(memchr(str, byte, end - str));
+      if (p == NULL) {
+        str = end;
+        break;
+      }
+      str = p;
+    }
+    const std::size_t klass = alphabet_[*str];
+    next = Util::load_acquire(&som_next_[state*k+klass]);
+    if (next == UNDEF) {
+      state_lock_.lock();
+      if ((next = som_next_[state*k+klass]) == UNDEF) {
+        if (!SOMCacheFull()) {
+          next = SOMNextState(state, klass);
+        } else {
+          // the current state survives the flush (with a new id), the
+          // transition is built before the others may fill the cache.
+          SOMGroups groups(*som_groups_[state]);
+          state_lock_.unlock();
+          som_cache_lock_.unlock_shared();
+          som_cache_lock_.lock();
+          state_lock_.lock();
+          SOMFlushCache();
+          state = SOMLazyState(groups);
+          next = SOMNextState(state, klass);
+          state_lock_.unlock();
+          som_cache_lock_.unlock_and_lock_shared();
+          state_lock_.lock();
+        }
+      }
+      state_lock_.unlock();
+    }
+    if (next == REJECT) break;
+    const uint32_t mapid = som_map_[state*k+klass];
+    if (mapid != 0) {
+      const std::vector<uint32_t> &map = som_maps_[mapid];
+      starts_.resize(map.size());
+      for (std::size_t i = 0; i < map.size(); i++) {
+        starts_[i] = map[i] == UNDEF ? str : starts[map[i]];
+      }
+      starts.swap(starts_);
+    }
+    str++;
+    state = next;
+    if ((accept_group = som_accept_[state]) >= 0) {
+      matchptr = str;
+      start = (std::size_t)accept_group < starts.size() ? starts[accept_group] : str;
+    }
+  }
+
+  bool accept = false;
+  if (str == end && next != REJECT && !(accept = som_accept_[state] >= 0)) {
+    Subset states;
+    const std::vector<Subset> &groups = som_groups_[state]->first;
+    for (std::size_t i = 0; i < groups.size(); i++) states.insert(groups[i].begin(), groups[i].end());
+    ExpandStates(&states, string.empty(), true);
+    accept = ContainAcceptState(states);
+  }
+  som_cache_lock_.unlock_shared();
+  if (!SetResult(string, accept, matchptr, result)) return false;
+  if (result != NULL && matchptr != NULL) result->set_ubegin(start);
+  return true;
 }
 
 } // namespace regen
@@ -16,25 +16,48 @@ namespace regen {
 class DFA;
 class JITCompiler: public Xbyak::CodeGenerator {
  public:
-  JITCompiler(const DFA &dfa, std::size_t state_code_size);
+  /* count: accept states count their line and restart at the next one
+     (see DFA::Count), instead of returning. */
+  JITCompiler(const DFA &dfa, std::size_t state_code_size, bool count = false);
   std::size_t CodeSize() { return total_segment_size_; };
  private:
+  /* jump to the state of index, the address table holds 32bit offsets
+     of states from the data segment (so the code is position independent). */
+  void JumpState(const Xbyak::Reg32e &tbl, const Xbyak::Reg32e &index, const Xbyak::Reg32e &tmp);
   std::size_t code_segment_size_;
   std::size_t data_segment_size_;
   std::size_t total_segment_size_;
-  std::vector<const uint8_t *> filter_table_;
   std::vector<const uint8_t*> states_addr_;
   const uint8_t *filter_entry_;
   uint32_t reset_state_;
-  static std::size_t code_segment_size(std::size_t state_num) {
-    const std::size_t setup_code_size_ = 16;
-    const std::size_t state_code_size_ = 64;
+  /* a state which loops on itself except (at most skip_exits) bytes,
+     its loop is skipped by SIMD search of the exit bytes. */
+  enum { skip_exits = 3, skip_code_size = 128, count_code_size = 192 };
+  static bool SkipExits(const DFA &dfa, std::size_t state, std::vector<unsigned char> *exits);
+  static std::size_t skip_state_num(const DFA &dfa);
+  static std::size_t code_segment_size(std::size_t state_num, std::size_t skip_num, bool stride, bool count) {
+    const std::size_t setup_code_size_ = 16 + (count ? count_code_size : 0);
+    const std::size_t state_code_size_ = stride ? 128 : 64;
     const std::size_t segment_align = 4096;    
-    return (state_num*state_code_size_ + setup_code_size_)
-        +  ((state_num*state_code_size_ + setup_code_size_) % segment_align);
+    const std::size_t code_size = state_num*state_code_size_ + skip_num*skip_code_size + setup_code_size_;
+    return code_size + (code_size % segment_align);
   }
-  static std::size_t data_segment_size(std::size_t state_num) {
-    return state_num * 256 * sizeof(void *);
+  /* byte -> class map (256 bytes), byte -> filter map (256 bytes),
+     keyword (8 bytes, and its first and last byte repeated 16 times),
+     state offsets (and reject, filter), class-indexed tables of
+     state ids (width bytes each), (16 byte alligned) exit bytes of
+     skipped states, each repeated 16 times, and the stride table
+     (if any, in the layout of DFA's one). */
+  enum { filter_offset = 256, keyword_offset = 512, address_offset = 576 };
+  static std::size_t skip_offset(std::size_t state_num, std::size_t alphabet_size, std::size_t width) {
+    return (address_offset + (state_num + 2) * sizeof(int32_t) + state_num * alphabet_size * width + 15) & ~15;
+  }
+  static std::size_t stride_offset(std::size_t state_num, std::size_t alphabet_size, std::size_t width, std::size_t skip_num) {
+    return skip_offset(state_num, alphabet_size, width) + skip_num * skip_exits * 16;
+  }
+  static std::size_t data_segment_size(std::size_t state_num, std::size_t alphabet_size, std::size_t width, std::size_t skip_num, bool stride) {
+    return stride_offset(state_num, alphabet_size, width, skip_num)
+        + (stride ? state_num * alphabet_size * alphabet_size * width : 0);
   }
 };
 #endif
@@ -48,12 +71,30 @@ public:
     REJECT = (state_t)-1,
     UNDEF  = (state_t)-2
   };
-  struct Transition {
-    state_t t[256];
-    Transition(state_t fill = UNDEF) { std::fill(t, t+256, fill); }
-    void fill(state_t fill) { std::fill(t, t+256, fill); }
-    state_t &operator[](std::size_t index) { return t[index]; }
-    const state_t &operator[](std::size_t index) const { return t[index]; }
+  /* Byte equivalence classes.
+     bytes that no position of the expression can tell apart share
+     one class, transition tables are indexed by class (not by byte). */
+  struct Alphabet {
+    Alphabet() { clear(); }
+    unsigned char map[256];
+    unsigned char rep[256];
+    std::size_t size;
+    unsigned char operator[](std::size_t c) const { return map[c]; }
+    void clear() { size = 256; for (std::size_t c = 0; c < 256; c++) map[c] = rep[c] = c; }
+    void Split(const std::bitset<256> &set);
+    void Normalize();
+  };
+  class Transition {
+   public:
+    Transition(state_t *t, const Alphabet *alphabet): t_(t), alphabet_(alphabet) {}
+    void fill(state_t fill) { std::fill(t_, t_+alphabet_->size, fill); }
+    state_t &operator[](std::size_t index) { return t_[(*alphabet_)[index]]; }
+    const state_t &operator[](std::size_t index) const { return t_[(*alphabet_)[index]]; }
+    state_t &at(std::size_t klass) { return t_[klass]; }
+    const state_t &at(std::size_t klass) const { return t_[klass]; }
+   private:
+    state_t *t_;
+    const Alphabet *alphabet_;
   };
   struct AlterTrans {
     std::pair<unsigned char, unsigned char> key;
@@ -61,8 +102,8 @@ public:
     state_t next2;
   };
   struct State {
-    State(): transitions(NULL), accept(false), endline(false), id(UNDEF), inline_level(0) {}
-    std::vector<Transition> *transitions;
+    State(): dfa(NULL), accept(false), endline(false), id(UNDEF), inline_level(0) {}
+    const DFA *dfa;
     bool accept;
     bool endline;
     state_t id;
@@ -70,30 +111,57 @@ public:
     std::set<state_t> src_states;
     AlterTrans alter_transition;
     std::size_t inline_level;
-    state_t &operator[](std::size_t index) { return (*transitions)[id][index]; }
-    const state_t &operator[](std::size_t index) const { return (*transitions)[id][index]; }
+    state_t &operator[](std::size_t index) { return dfa->trans(id, index); }
+    const state_t &operator[](std::size_t index) const { return dfa->trans(id, index); }
+  };
+  /* Interned subsets of positions.
+     each subset is stored once (sorted, with its hash) and is shared by
+     both lookups: subset -> state (construction) and state -> subset. */
+  class SubsetTable {
+   public:
+    SubsetTable(): buckets_(16, 0) {}
+    state_t Find(const Subset &subset) const;
+    void Insert(const Subset &subset, state_t state);
+    void Get(state_t state, Subset *subset) const;
+    std::size_t size() const { return entries_.size(); }
+    std::size_t memory() const;
+    void clear();
+   private:
+    struct Entry {
+      std::size_t hash;
+      state_t state;
+      std::size_t begin, end;
+    };
+    static std::size_t Hash(const Subset &subset);
+    bool Equal(const Entry &entry, const Subset &subset) const;
+    void Rehash();
+    std::vector<std::size_t> buckets_; // entry index + 1, 0 is empty.
+    std::vector<Entry> entries_;
+    std::vector<StateExpr*> positions_;
+    std::vector<std::size_t> state_entry_;
   };
   typedef std::deque<State>::iterator iterator;
   typedef std::deque<State>::const_iterator const_iterator;
 
-  DFA(const Regen::Options flag = Regen::Options::NoParseFlags): complete_(false), minimum_(false), flag_(flag), olevel_(Regen::Options::O0)
+  DFA(const Regen::Options flag = Regen::Options::NoParseFlags): complete_(false), minimum_(false), flag_(flag), olevel_(Regen::Options::O0),
+    cache_generation_(0), cache_budget_(0), cache_flushes_(0), nfa_fallbacks_(0),
+    match_table_(NULL), match_accept_(NULL), match_eol_(NULL), match_stride_(NULL), table_width_(4), image_(NULL)
 #ifdef REGEN_ENABLE_JIT
-  , xgen_(NULL)
+  , xgen_(NULL), xcount_(NULL), jitter_(NULL), code_(NULL), code_size_(0)
 #endif
+  , som_generation_(0)
   {}
   DFA(const ExprInfo &expr_info, std::size_t limit = std::numeric_limits<size_t>::max());
   DFA(const NFA &nfa, std::size_t limit = std::numeric_limits<size_t>::max());
-  #if REGEN_ENABLE_JIT
-  virtual ~DFA() { delete xgen_; }
-  #else
-  virtual ~DFA() { }
-  #endif
+  virtual ~DFA();
   
-  bool empty() const { return transition_.empty(); }
-  std::size_t size() const { return transition_.size(); }
+  bool empty() const { return states_.empty(); }
+  std::size_t size() const { return states_.size(); }
   state_t start_state() const { return 0; }
   Regen::Options::CompileFlag olevel() const { return olevel_; };
   bool Complete() const { return complete_; }
+  std::size_t cache_flushes() const { return cache_flushes_; }
+  std::size_t nfa_fallbacks() const { return nfa_fallbacks_; }
 
   State& get_new_state() const;
   const ExprInfo &expr_info() const { return expr_info_; }
@@ -103,22 +171,68 @@ public:
   const std::set<state_t> &src_states(std::size_t i) const { return states_[i].src_states; }
   const std::set<state_t> &dst_states(std::size_t i) const { return states_[i].dst_states; }
   const AlterTrans &GetAlterTrans(std::size_t state) const { return states_[state].alter_transition; }
-  const Transition &GetTransition(std::size_t state) const { return transition_[state]; }
+  const Transition GetTransition(std::size_t state) const { return Transition(&transition_[state*alphabet_.size], &alphabet_); }
+  Transition GetTransition(std::size_t state) { return Transition(&transition_[state*alphabet_.size], &alphabet_); }
+  const Alphabet &alphabet() const { return alphabet_; }
+  /* narrowest state id (in bytes) which can index the transition table,
+     the two largest ids are REJECT and UNDEF. */
+  static std::size_t TableWidth(std::size_t state_num) { return state_num <= 254 ? 1 : state_num <= 65534 ? 2 : 4; }
+  std::size_t table_width() const { return complete_ ? table_width_ : TableWidth(size()); }
+  /* two byte stride table (see Options::stride_limit), indexed by
+     state*k*k + class1*k + class2 (k is the alphabet size). */
+  bool HasStrideTable() const { return match_stride_ != NULL; }
   bool IsAcceptState(std::size_t state) const { return state == REJECT ? false : states_[state].accept; }
   bool IsEndlineState(std::size_t state) const { return state == REJECT ? false : states_[state].endline; }
   bool IsAcceptOrEndlineState(std::size_t state)  const { return IsAcceptState(state) | IsEndlineState(state); }
+  /* acceptance at the end of (empty) input, complete DFAs only. */
+  bool IsEOLAcceptState(std::size_t state, bool empty = false) const { return match_eol_[state] & (empty ? 2 : 1); }
 
   bool ContainAcceptState(const Subset&) const;
   void ExpandStates(Subset*, bool begline = false, bool endline = false) const;
   void FillTransition(StateExpr*, std::vector<Subset>*) const;
+  void NextStates(const Subset&, unsigned char, Subset*) const;
+  void FillAlphabet() const;
   void MakeNonGreedy(StateExpr*) const;
   void TrimNonGreedy(Subset*) const;
 
+  /* position independent image of a complete DFA (tables used by Match),
+     offsets are relative to the image. */
+  struct Image {
+    uint32_t state_num;
+    uint32_t alphabet_size;
+    uint32_t table_width;
+    uint32_t reserved;
+    uint64_t table_offset;
+    uint64_t size;
+    unsigned char alphabet[256];
+  };
+  bool Save(std::string *image) const;
+  bool Map(const char *image);
+  // the header's table layout is the one Map expects, and the tables
+  // (size bytes from the header at most) only refer to their states.
+  static bool ValidImage(const Image *header, std::size_t size);
+  bool Mapped() const { return image_ != NULL; }
+
   void Complementify();
   virtual bool Minimize();
   bool Compile(Regen::Options::CompileFlag olevel = Regen::Options::O2);
   virtual bool OnTheFlyMatch(const Regen::StringPiece& string, Regen::StringPiece* result = NULL) const;
   virtual bool Match(const Regen::StringPiece& string, Regen::StringPiece* result = NULL) const;
+  /* the number of lines (split by the delimiter) which match, a match
+     skips the rest of its line, like a loop of Match calls does. */
+  std::size_t Count(const Regen::StringPiece& string) const;
+  /* results[i] is whether strings[i] has a match (as Match with a result),
+     the strings are matched in lockstep, which overlaps their table loads. */
+  void MatchMany(const Regen::StringPiece *strings, std::size_t n, bool *results) const;
+  /* partial matching which also reports the leftmost start of the match
+     (result->begin()) in the same forward pass, needs the positions of
+     the expression (not available for mapped images), and groups move
+     with their positions only without intersection and xor. */
+  bool SOMAvailable() const {
+    return expr_info_.prefix != NULL && !flag_.reverse_match()
+        && expr_info_.xor_num == 0 && expr_info_.intersection_num == 0;
+  }
+  bool SOMMatch(const Regen::StringPiece& string, Regen::StringPiece* result) const;
   void state2label(state_t state, char* labelbuf) const;
 
   bool Construct(std::size_t limit = std::numeric_limits<size_t>::max());
@@ -132,24 +246,96 @@ public:
   const State &operator[](std::size_t index) const { return states_[index]; }
   
 protected:
-  mutable std::vector<Transition> transition_;
+  state_t &trans(state_t state, unsigned char c) const { return transition_[state*alphabet_.size+alphabet_[c]]; }
+  mutable Alphabet alphabet_;
+  mutable std::vector<state_t> transition_;
   mutable std::deque<State> states_;
-  mutable std::map<Subset, state_t> dfa_map_;
-  mutable std::map<state_t, Subset> nfa_map_;
+  mutable SubsetTable subsets_;
   ExprInfo expr_info_;
   mutable ExprPool pool_;
   mutable bool complete_;
   bool minimum_;
   Regen::Options flag_;
   void Finalize();
+  std::size_t Refine(const std::vector<std::size_t> &key, std::vector<std::size_t> *blk) const;
+  /* a batch of states expanded by Construct (possibly in parallel). */
+  struct ConstructBatch {
+    state_t first;
+    std::vector<std::vector<Subset> > transitions;
+    std::vector<state_t> next;
+    std::vector<uint8_t> accept;
+  };
+  void ConstructTask(ConstructBatch *batch, std::size_t task, std::size_t task_num) const;
+  bool SetResult(const Regen::StringPiece&, bool, const unsigned char*, Regen::StringPiece*) const;
+  state_t LazyState(const Subset&) const;
+  state_t FlushCache(const Subset&) const;
+  void ReserveCache() const;
+  std::size_t CacheMemory() const;
+  bool CacheFull() const;
   state_t (*CompiledMatch)(const unsigned char**, const unsigned char**, state_t);
   bool EliminateBranch();
   bool Reduce();
   Regen::Options::CompileFlag olevel_;
+  mutable std::vector<uint8_t> accept_;
+  std::vector<uint8_t> eol_accept_;
+  std::vector<uint8_t> table8_;
+  std::vector<uint16_t> table16_;
+  std::vector<uint8_t> stride_table_;
+  void BuildStrideTable();
+  template<class T> state_t TableMatch(const T*, const T*, const unsigned char**, const unsigned char*, int, const unsigned char**) const;
+  template<class T> void LockstepMatch(const T*, const Regen::StringPiece*, std::size_t, bool*) const;
+  mutable Util::shared_mutex_t cache_lock_;
+  mutable Util::mutex_t state_lock_;
+  mutable std::size_t cache_generation_;
+  // memory of the on-the-fly DFA before a flush (the seed of Construct in it).
+  mutable std::size_t cache_budget_;
+  mutable std::size_t cache_flushes_;
+  mutable std::size_t nfa_fallbacks_;
+  /* tables of Match, built by Finalize or mapped from an image. */
+  const void *match_table_;
+  const uint8_t *match_accept_;
+  const uint8_t *match_eol_;
+  const void *match_stride_;
+  std::size_t table_width_;
+  const Image *image_;
 #if REGEN_ENABLE_JIT
   JITCompiler *xgen_;
+  mutable JITCompiler *xcount_; // built by the first Count.
   mutable Jitter *jitter_;
+  /* code cache (see Options::jit_cache), code_ is mapped from a cache file. */
+  uint64_t CodeCacheKey() const;
+  bool LoadCode(const std::string &path);
+  bool SaveCode(const std::string &path) const;
+  void *code_;
+  std::size_t code_size_;
 #endif
+  /* start of match tracking (see SOMMatch), a state splits the positions
+     of a DFA state by the start of their threads: groups[0] holds the
+     prefix (.*?), the others are ordered by start, oldest first.
+     the youngest group is fresh if it starts at the current byte.
+     rows are indexed by byte class, shared like the on-the-fly DFA:
+     read without locks, built under state_lock_, and som_cache_lock_
+     is held shared while matching (exclusive to flush). */
+  typedef std::pair<std::vector<Subset>, bool> SOMGroups;
+  state_t SOMLazyState(const SOMGroups &groups) const;
+  state_t SOMNextState(state_t state, std::size_t klass) const;
+  void SOMFlushCache() const;
+  bool SOMCacheFull() const;
+  int SOMExitByte(state_t state) const;
+  mutable std::map<SOMGroups, state_t> som_index_;
+  mutable std::vector<const SOMGroups*> som_groups_;
+  mutable std::vector<int32_t> som_accept_; // oldest accepting group, -1 if none.
+  mutable std::vector<state_t> som_next_;
+  // the only byte which leaves a (not accepting) state without starts,
+  // -1 if none, UNDEF if unknown yet.
+  mutable std::vector<int> som_exit_;
+  // per transition, the source group of each (not fresh) group of the
+  // next state (UNDEF: the fresh one), 0 is the identity.
+  mutable std::vector<uint32_t> som_map_;
+  mutable std::map<std::vector<uint32_t>, uint32_t> som_map_index_;
+  mutable std::vector<std::vector<uint32_t> > som_maps_;
+  mutable Util::shared_mutex_t som_cache_lock_;
+  mutable std::size_t som_generation_;
   std::vector<AlterTrans> alter_trans_;
   std::vector<std::size_t> inline_level_;
 private:
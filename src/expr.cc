@@ -198,11 +198,12 @@ top:
 
 void CharClass::FillKeywords(Keywords *key, std::bitset<256> *involve)
 {
-  *involve = table_;
-  if (negative_) involve->flip();
+  std::bitset<256> table = table_;
+  if (negative_) table.flip();
+  *involve |= table;
   if (key != NULL) {
     for (std::size_t i = 0; i < 256; i++) {
-      if (involve->test(i)) {
+      if (table.test(i)) {
         key->in.insert(std::string(1, i));
       }
     }
@@ -523,10 +524,11 @@ Intersection::Intersection(Expr *lhs, Expr *rhs, ExprPool *p):
 void Intersection::FillPosition(ExprInfo* info)
 {
   ExprInfo tmp_info = *info;
-  std::size_t xor_num = info->xor_num;
+  std::size_t xor_num = info->xor_num, intersection_num = info->intersection_num;
   lhs_->FillPosition(&tmp_info);
   rhs_->FillPosition(info);
   info->xor_num += tmp_info.xor_num - xor_num;
+  info->intersection_num += tmp_info.intersection_num - intersection_num + 1;
 
   nullable_ = lhs__->nullable() & rhs__->nullable();
   max_length_ = std::min(lhs__->max_length(), rhs__->max_length());
@@ -632,7 +634,7 @@ void Qmark::FillPosition(ExprInfo *info)
 {
   lhs_->FillPosition(info);
   
-  max_length_ = lhs_->min_length();
+  max_length_ = lhs_->max_length();
   min_length_ = 0;
   nullable_ = true;
   first() = lhs_->first();
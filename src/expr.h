@@ -50,18 +50,20 @@ struct Keywords {
   std::set<std::string> in;
   std::set<std::string> candidates;
   const std::string& longest_keyword() const
-  { static const std::string empty; return in.empty() ? empty : *std::max_element(in.begin(), in.end(), compare_keywords); }
+  { static const std::string empty; return in.empty() ? empty : *std::min_element(in.begin(), in.end(), compare_keywords); }
   bool no_candidates;
 };
 
 struct ExprInfo {
-  ExprInfo(): xor_num(0), expr_root(NULL), orig_root(NULL), copied_root(NULL), extra_top(NULL), eop(NULL), min_length(0), max_length(0) {}
+  ExprInfo(): xor_num(0), intersection_num(0), expr_root(NULL), orig_root(NULL), copied_root(NULL), extra_top(NULL), eop(NULL), prefix(NULL), min_length(0), max_length(0) {}
   std::size_t xor_num;
+  std::size_t intersection_num;
   Expr *expr_root;
   Expr *orig_root;
   Expr *copied_root;
   Expr *extra_top;
   EOP *eop;
+  StateExpr *prefix; // the dot of .*? (partial matching)
   std::size_t min_length;
   std::size_t max_length;
   std::bitset<256> involve;
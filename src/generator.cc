@@ -54,30 +54,151 @@ void DotGenerate(const DFA &dfa)
   puts("}");
 }
 
-void CGenerate(const DFA &dfa)
+namespace {
+
+struct Range {
+  unsigned int lo, hi;
+  DFA::state_t next;
+};
+
+/* binary search over the (coalesced) ranges of bytes. */
+void EmitRanges(FILE *out, const std::vector<Range> &ranges, std::size_t lo, std::size_t hi, int indent)
 {
-  puts("typedef unsigned char  UCHAR;");
-  puts("typedef unsigned char *UCHARP;");
+  if (lo == hi) {
+    if (ranges[lo].next == DFA::REJECT) {
+      fprintf(out, "%*sgoto reject;\n", indent, "");
+    } else {
+      fprintf(out, "%*sgoto s%u;\n", indent, "", ranges[lo].next);
+    }
+    return;
+  }
+  std::size_t mid = (lo + hi + 1) / 2;
+  fprintf(out, "%*sif (c < %u) {\n", indent, "", ranges[mid].lo);
+  EmitRanges(out, ranges, lo, mid - 1, indent + 2);
+  fprintf(out, "%*s} else {\n", indent, "");
+  EmitRanges(out, ranges, mid, hi, indent + 2);
+  fprintf(out, "%*s}\n", indent, "");
+}
+
+} // namespace
+
+/* self-contained C (no runtime code generation), a label per state, its
+   transitions are tested for the ranges of bytes which leave the most
+   frequent target (a self loop with one exit byte is skipped by memchr).
+   the result is the one of DFA::Match, the code is written to out. */
+void CGenerate(const DFA &dfa, FILE *out)
+{
+  if (!dfa.Complete()) exitmsg("DFA is not complete.");
+  if (dfa.flag().reverse_match()) exitmsg("reverse matching is not supported.");
+
+  std::vector<std::vector<Range> > ranges(dfa.size());
+  std::vector<DFA::state_t> fallback(dfa.size());
+  std::vector<bool> target(dfa.size(), false), skip(dfa.size(), false);
+  bool reject = false, branch = false, skip_loop = false;
   for (std::size_t i = 0; i < dfa.size(); i++) {
     const DFA::Transition &transition = dfa.GetTransition(i);
-    printf("void s%"PRIuS"(UCHARP beg, UCHARP buf, UCHARP end)\n{\n", i);
-    if (dfa.IsAcceptOrEndlineState(i)) {
-      puts("  return accept(beg, buf, end);");
+    std::map<DFA::state_t, std::size_t> count;
+    for (unsigned int c = 0; c < 256; c++) {
+      if (c == 0 || transition[c] != ranges[i].back().next) {
+        Range range = {c, c, transition[c]};
+        ranges[i].push_back(range);
+      } else {
+        ranges[i].back().hi = c;
+      }
+      count[transition[c]]++;
+    }
+    fallback[i] = count.begin()->first;
+    for (std::map<DFA::state_t, std::size_t>::iterator iter = count.begin(); iter != count.end(); ++iter) {
+      if (iter->second > count[fallback[i]]) fallback[i] = iter->first;
+    }
+    skip[i] = fallback[i] == i && count[i] == 255 && !dfa.IsAcceptState(i);
+    if (skip[i]) {
+      skip_loop = true;
+    } else if (ranges[i].size() > 1) {
+      branch = true;
+    }
+    // a label for the targets of gotos only (memchr loops have none).
+    for (std::size_t j = 0; j < ranges[i].size(); j++) {
+      if (ranges[i][j].next == DFA::REJECT) reject = true;
+      else if (!skip[i] || ranges[i][j].next != i) target[ranges[i][j].next] = true;
+    }
+  }
+
+  fprintf(out, "/* DFA of %" PRIuS " states, generated by regen. */\n", dfa.size());
+  fputs("#include <stddef.h>\n", out);
+  if (skip_loop) fputs("#include <string.h>\n", out);
+  fputs("\n/* returns 1 if [begin, end) is accepted, the end of the match is stored\n", out);
+  fputs("   to *matchend (if matchend is not NULL). */\n", out);
+  fputs("int match(const unsigned char *begin, const unsigned char *end, const unsigned char **matchend)\n", out);
+  fputs("{\n", out);
+  // a full match is the accepted string, a partial one ends at the last acceptance.
+  const bool suffix = dfa.flag().suffix_match();
+  fputs(suffix ? "  const unsigned char *p = begin;\n" : "  const unsigned char *p = begin, *m = NULL;\n", out);
+  if (skip_loop) fputs("  const unsigned char *q;\n", out);
+  if (branch) fputs("  unsigned int c;\n", out);
+  fputs("  int accept;\n\n", out);
+  for (std::size_t i = 0; i < dfa.size(); i++) {
+    if (target[i]) fprintf(out, "s%" PRIuS ":\n", i);
+    char eol[32];
+    if (dfa.IsAcceptState(i)) {
+      if (!suffix) fputs("  m = p;\n", out);
+      sprintf(eol, "1");
+    } else if (i == 0 && dfa.IsEOLAcceptState(i, true) != dfa.IsEOLAcceptState(i)) {
+      sprintf(eol, "p == begin ? %d : %d", dfa.IsEOLAcceptState(i, true), dfa.IsEOLAcceptState(i));
     } else {
-      printf("  static void (*table[256])(UCHARP, UCHARP, UCHARP) = { \n  ");
-      for (int j = 0; j < 256; j++) {
-        if (transition[j] == DFA::REJECT) {
-          printf("reject");
-        } else {
-          printf("s%d", transition[j]);
-        }
-        if (j < 255) printf(", ");
+      sprintf(eol, "%d", dfa.IsEOLAcceptState(i));
+    }
+    if (skip[i]) {
+      std::size_t j = 0;
+      while (ranges[i][j].next == i) j++;
+      fprintf(out, "  q = (const unsigned char *)memchr(p, %u, (size_t)(end - p));\n", ranges[i][j].lo);
+      fprintf(out, "  if (q == NULL) { accept = %s; goto done; }\n", eol);
+      fputs("  p = q + 1;\n", out);
+      EmitRanges(out, ranges[i], j, j, 2);
+      continue;
+    }
+    fprintf(out, "  if (p == end) { accept = %s; goto done; }\n", eol);
+    if (ranges[i].size() == 1) {
+      fputs("  p++;\n", out);
+      EmitRanges(out, ranges[i], 0, 0, 2);
+      continue;
+    }
+    fputs("  c = *p++;\n", out);
+    std::vector<Range> exits;
+    for (std::size_t j = 0; j < ranges[i].size(); j++) {
+      if (ranges[i][j].next != fallback[i]) exits.push_back(ranges[i][j]);
+    }
+    if (exits.size() > 4) {
+      EmitRanges(out, ranges[i], 0, ranges[i].size() - 1, 2);
+      continue;
+    }
+    for (std::size_t j = 0; j < exits.size(); j++) {
+      if (exits[j].lo == exits[j].hi) {
+        fprintf(out, "  if (c == %u)", exits[j].lo);
+      } else if (exits[j].lo == 0) {
+        fprintf(out, "  if (c <= %u)", exits[j].hi);
+      } else {
+        fprintf(out, "  if (c - %uu <= %uu)", exits[j].lo, exits[j].hi - exits[j].lo);
+      }
+      if (exits[j].next == DFA::REJECT) {
+        fputs(" goto reject;\n", out);
+      } else {
+        fprintf(out, " goto s%u;\n", exits[j].next);
       }
-      puts("  };");
-      puts("  return table[*buf++](beg, buf, end);");
     }
-    puts("}");
-  }  
+    Range range = {0, 0, fallback[i]};
+    EmitRanges(out, std::vector<Range>(1, range), 0, 0, 2);
+  }
+  if (reject) fputs("reject:\n  accept = 0;\n", out);
+  fputs("done:\n", out);
+  if (suffix) {
+    fputs("  if (accept && matchend != NULL) *matchend = end;\n", out);
+  } else {
+    fputs("  if (m != NULL) accept = 1;\n", out);
+    fputs("  if (accept && matchend != NULL) *matchend = m;\n", out);
+  }
+  fputs("  return accept;\n", out);
+  fputs("}\n", out);
 }
 
 } // namespace Generator
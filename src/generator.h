@@ -9,7 +9,7 @@ namespace regen {
 namespace Generator {
 
 void DotGenerate(const DFA &dfa);
-void CGenerate(const DFA &dfa);
+void CGenerate(const DFA &dfa, FILE *out = stdout);
 
 } // namespace Generator
 
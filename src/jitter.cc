@@ -6,13 +6,12 @@ namespace regen {
 CodeSegment::CodeSegment(const DFA &dfa, Jitter &jitter, std::size_t code_segment_size):
     CodeGenerator(code_segment_size),
     dfa_(dfa), jitter_(jitter), code_segment_size_(code_segment_size),
-    reject_addr_(NULL), return_addr_(NULL),
 #ifdef XBYAK32
     arg1(ecx), arg2(edx), arg3(ebx),
     tbl (ebp), tmp1(esi), tmp2(edi), reg_a(eax)
 #elif defined(XBYAK64_WIN)
     arg1(rcx), arg2(rdx), arg3(r8),
-    tbl (r9), tmp1(r10), tmp2(r11), reg_a(rax),
+    tbl (r9), tmp1(r10), tmp2(r11), reg_a(rax)
 #else
     arg1(rdi), arg2(rsi), arg3(rdx),
     tbl (r8), tmp1(r10), tmp2(r11), reg_a(rax)
@@ -20,6 +19,8 @@ CodeSegment::CodeSegment(const DFA &dfa, Jitter &jitter, std::size_t code_segmen
 {
 }
 
+/* state_t func(const unsigned char *string[2], const unsigned char **matchptr, const void *state_code)
+ * string[0] is updated to the current position. */
 const void* CodeSegment::EmitFunc()
 {
   const void* func_ptr = getCurr();
@@ -33,17 +34,22 @@ const void* CodeSegment::EmitFunc()
   mov(arg2, ptr [esp + P_ + 8]);
   mov(arg3, ptr [esp + P_ + 12]);
 #endif
-  mov(tmp2, 0);
-  jmp("s0");
-  L("reject");
-  reject_addr_ = getCurr();
+  push(arg2);
+  push(arg1);
+  mov(tmp2, ptr[arg2]);
+  mov(arg2, ptr[arg1+sizeof(uint8_t*)]);
+  mov(arg1, ptr[arg1]);
+  jmp(arg3);
+  align(16);
+
+  jitter_.reject_addr_ = getCurr();
   mov(reg_a, DFA::REJECT); // return false
-  L("return");
-  return_addr_ = getCurr();
-  cmp(arg3, 0);
-  je("finalize");
-  mov(ptr[arg3+sizeof(uint8_t*)], tmp2);
-  L("finalize");
+
+  jitter_.return_addr_ = getCurr();
+  pop(tmp1);
+  mov(ptr[tmp1], arg1);
+  pop(tmp1);
+  mov(ptr[tmp1], tmp2);
 #ifdef XBYAK32
   pop(ebx);
   pop(ebp);
@@ -58,14 +64,98 @@ const void* CodeSegment::EmitFunc()
 
 const void* CodeSegment::EmitState(std::size_t state)
 {
+  Jitter::StateInfo &info = jitter_.state_info(state);
+  const int sign = dfa_.flag().reverse_match() ? -1 : 1;
   const void* state_ptr = getCurr();
+  inLocalLabel();
+  if (dfa_.IsAcceptState(state) && !dfa_.flag().suffix_match()) {
+    mov(tmp2, arg1);
+    if (dfa_.flag().shortest_match()) {
+      mov(reg_a, state);
+      jmp(".return");
+    }
+  }
+  cmp(arg1, arg2);
+  je(".ret");
+  movzx(tmp1, byte[arg1]);
+  add(arg1, sign);
+  mov(tbl, (size_t)info.transition->t);
+  jmp(ptr[tbl+tmp1*sizeof(void*)]);
+  // missing transition: step back to the byte, and return to the builder.
+  info.miss = getCurr();
+  sub(arg1, sign);
+  L(".ret");
+  mov(reg_a, state);
+  L(".return");
+  mov(tmp1, (size_t)jitter_.return_addr());
+  jmp(tmp1);
+  outLocalLabel();
+  align(16);
+
   return state_ptr;
 }
 
-void Jitter::Init()
+const void *Jitter::Code(state_t state)
+{
+  if (state >= state_info_.size()) state_info_.resize(dfa_.size());
+  StateInfo &info = state_info_[state];
+  if (info.addr != NULL) return info.addr;
+
+  if (CS()->Full()) NewCS();
+  info.transition = &NewTransition(NULL);
+  info.addr = CS()->EmitState(state);
+  // transitions which are known already.
+  Transition &t = *info.transition;
+  for (std::size_t c = 0; c < 256; c++) {
+    const state_t next = dfa_[state][c];
+    if (next == DFA::REJECT) {
+      t[c] = reject_addr_;
+    } else if (next != DFA::UNDEF && next < state_info_.size() && state_info_[next].addr != NULL) {
+      t[c] = state_info_[next].addr;
+    } else {
+      t[c] = info.miss;
+    }
+  }
+  if (state < addr_.size()) Util::store_release(&addr_[state], info.addr);
+  return info.addr;
+}
+
+void Jitter::Patch(state_t state, unsigned char c, state_t next)
 {
+  if (state >= state_info_.size() || state_info_[state].addr == NULL) return;
+  const void *addr = next == DFA::REJECT ? reject_addr_ : Code(next);
+  Transition &t = *state_info_[state].transition;
+  // every byte of the class shares the transition.
+  const unsigned char klass = dfa_.alphabet()[c];
+  for (std::size_t b = 0; b < 256; b++) {
+    if (dfa_.alphabet()[b] == klass) t[b] = addr;
+  }
+}
+
+Jitter::state_t Jitter::Match(const void *code, const unsigned char **str, const unsigned char *end, const unsigned char **matchptr) const
+{
+  const unsigned char *string[2] = { *str, end };
+  state_t state = ((state_t (*)(const unsigned char**, const unsigned char**, const void*))func_ptr_)(string, matchptr, code);
+  *str = string[0];
+  return state;
+}
+
+void Jitter::Init(std::size_t state_num)
+{
+  addr_.assign(state_num, NULL);
   NewCS();
   func_ptr_ = CS()->EmitFunc();
 }
 
+void Jitter::Clear()
+{
+  for (std::vector<CodeSegment *>::iterator i = code_segments_.begin(); i != code_segments_.end(); ++i) delete *i;
+  code_segments_.clear();
+  data_segment_.clear();
+  state_info_.clear();
+  addr_.clear();
+  memory_ = 0;
+  func_ptr_ = reject_addr_ = return_addr_ = NULL;
+}
+
 } // namespace regen
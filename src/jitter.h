@@ -3,24 +3,27 @@
 
 #include <vector>
 #include <list>
+#include <algorithm>
+#include <stdint.h>
 #include "xbyak/xbyak.h"
+#include "util.h"
 
 namespace regen {
 
 class Jitter;
 class DFA;
-  
+
 class CodeSegment: public Xbyak::CodeGenerator {
 public:
   CodeSegment(const DFA &dfa, Jitter &jitter, std::size_t code_segment_size);
   const void* EmitFunc();
   const void* EmitState(std::size_t state);
+  bool Full() const { return getSize() + state_code_size > code_segment_size_; }
+  enum { state_code_size = 96 };
   const DFA &dfa_;
   Jitter &jitter_;
   std::size_t CodeSegmentSize() { return code_segment_size_; };
   std::size_t code_segment_size_;
-  const void *reject_addr_;
-  const void *return_addr_;
 #ifdef XBYAK32
   const Xbyak::Reg32& arg1;
   const Xbyak::Reg32& arg2;
@@ -40,33 +43,63 @@ public:
 #endif
 };
 
+/* Lazy JIT of the on-the-fly DFA.
+   each state gets its code when it is reached first, the code jumps
+   through a byte-indexed table of addresses, the entries of unknown
+   transitions are stubs which return to the on-the-fly builder (the
+   builder adds the transition by Patch, and resumes).
+   the DFA serializes Code and Patch, and Reset (on a cache flush)
+   excludes running matchers. Lookup is lock free: the code address of a
+   state is published by a release store (like the DFA's transitions),
+   in a table sized by Reset which never grows. */
 class Jitter {
 public:
+  typedef uint32_t state_t;
   struct Transition {
-    void* t[256];
-    Transition(void* fill = NULL) { std::fill(t, t+256, fill); }
-    void* &operator[](std::size_t index) { return t[index]; }
+    const void* t[256];
+    Transition(const void* fill = NULL) { std::fill(t, t+256, fill); }
+    const void* &operator[](std::size_t index) { return t[index]; }
   };
   struct StateInfo {
-    StateInfo(Transition &t): addr(NULL), transition(t) {}
+    StateInfo(): addr(NULL), miss(NULL), transition(NULL) {}
     const void *addr;
-    Transition &transition;
+    const void *miss;
+    Transition *transition;
   };
-  Jitter(const DFA &dfa, std::size_t code_segment_size = 4096): dfa_(dfa), code_segment_size_(code_segment_size), func_ptr_(NULL)  {}
-  ~Jitter() { for (std::vector<CodeSegment *>::iterator i = code_segments_.begin(); i != code_segments_.end(); ++i) delete *i; }
+  Jitter(const DFA &dfa, std::size_t state_num, std::size_t code_segment_size = 4096): dfa_(dfa), code_segment_size_(code_segment_size), memory_(0), func_ptr_(NULL), reject_addr_(NULL), return_addr_(NULL) { Init(state_num); }
+  ~Jitter() { Clear(); }
 
   CodeSegment * CS() { return code_segments_.back(); }
-  CodeSegment * NewCS() { code_segments_.push_back(0); code_segments_.back() = new CodeSegment(dfa_, *this, code_segment_size_); return code_segments_.back(); }
+  CodeSegment * NewCS() { code_segments_.push_back(0); code_segments_.back() = new CodeSegment(dfa_, *this, code_segment_size_); memory_ += code_segment_size_; return code_segments_.back(); }
   StateInfo &state_info(std::size_t state) { return state_info_[state]; }
-  void Init();
+  Transition &NewTransition(const void *fill) { data_segment_.push_back(Transition(fill)); memory_ += sizeof(Transition); return data_segment_.back(); }
+  const void *reject_addr() const { return reject_addr_; }
+  const void *return_addr() const { return return_addr_; }
+  const void *Code(state_t state);
+  // the code of state, NULL if it is not emitted yet.
+  const void *Lookup(state_t state) const { return state < addr_.size() ? Util::load_acquire(&addr_[state]) : NULL; }
+  void Patch(state_t state, unsigned char c, state_t next);
+  /* runs from the code of state until the end of string, a reject or
+     a missing transition (then *str is the byte of the transition),
+     *matchptr is updated by accept states. */
+  state_t Match(const void *code, const unsigned char **str, const unsigned char *end, const unsigned char **matchptr) const;
+  void Reset(std::size_t state_num) { Clear(); Init(state_num); }
+  // code segments and transition tables (bytes).
+  std::size_t memory() const { return memory_ + addr_.size() * sizeof(const void*) + state_info_.size() * sizeof(StateInfo); }
 private:
+  friend class CodeSegment;
+  void Init(std::size_t state_num);
+  void Clear();
   const DFA &dfa_;
   std::size_t code_segment_size_;
+  std::size_t memory_;
+  std::vector<const void*> addr_;
   std::vector<CodeSegment *> code_segments_;
   std::list<Transition> data_segment_;
   std::vector<StateInfo> state_info_;
-  std::size_t state_num_;
   const void *func_ptr_;
+  const void *reject_addr_;
+  const void *return_addr_;
 };
 
 } // namespace regen
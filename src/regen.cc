@@ -12,7 +12,8 @@ Regen::Options::Options(Regen::Options::ParseFlag flag, const unsigned char deli
     complement_ext_(false), intersection_ext_(false), recursion_ext_(false), xor_ext_(false), shuffle_ext_(false),
     permutation_ext_(false), reverse_ext_(false), weakbackref_ext_(false),
     encoding_utf8_(false), non_nullable_(false),
-    delimiter_(delimiter)
+    delimiter_(delimiter), cache_size_(8 << 20), construct_threads_(1),
+    state_limit_(1000), memory_limit_(0), time_limit_(0), stride_limit_(64 << 10)
 {
   shortest_match_ = flag & ShortestMatch;
   ignore_case_ = flag & IgnoreCase;
@@ -36,19 +37,56 @@ Regen::Options::Options(Regen::Options::ParseFlag flag, const unsigned char deli
   non_nullable_ = flag & NonNullable;
 }
 
+Regen::Options::ParseFlag Regen::Options::parse_flag() const
+{
+  ParseFlag flag = NoParseFlags;
+  if (shortest_match_) flag |= ShortestMatch;
+  if (ignore_case_) flag |= IgnoreCase;
+  if (one_line_) flag |= OneLine;
+  if (reverse_regex_) flag |= ReverseRegex;
+  if (reverse_match_) flag |= ReverseMatch;
+  if (noprefix_match_) flag |= NoPrefixMatch;
+  if (nosuffix_match_) flag |= NoSuffixMatch;
+  if (parallel_match_) flag |= ParallelMatch;
+  if (captured_match_) flag |= CapturedMatch;
+  if (filtered_match_) flag |= FilteredMatch;
+  if (complement_ext_) flag |= ComplementExt;
+  if (intersection_ext_) flag |= IntersectionExt;
+  if (recursion_ext_) flag |= RecursionExt;
+  if (xor_ext_) flag |= XORExt;
+  if (shuffle_ext_) flag |= ShuffleExt;
+  if (permutation_ext_) flag |= PermutationExt;
+  if (reverse_ext_) flag |= ReverseExt;
+  if (weakbackref_ext_) flag |= WeakBackRefExt;
+  if (encoding_utf8_) flag |= EncodingUTF8;
+  if (non_nullable_) flag |= NonNullable;
+  return flag;
+}
+
+namespace {
+/* options of the reverse regex, which finds the start of a captured match
+   backwards from its end. */
+Regen::Options ReverseOptions(Regen::Options opt)
+{
+  opt.reverse(true);
+  opt.prefix_match(true);
+  opt.suffix_match(false);
+  opt.longest_match(true);
+  opt.captured_match(false);
+  return opt;
+}
+} // namespace
+
 Regen::Regen(const std::string &regex, const Regen::Options options):
-    regex_(NULL), reverse_regex_(NULL), flag_(options)
+    regex_(NULL), reverse_regex_(NULL), flag_(options), image_(NULL)
 {
   regex_ = new Regex(regex, flag_);
+  // the DFA tracks the start of a match itself (see DFA::SOMMatch),
+  // the reverse regex is left for the expressions it can't track.
   if (flag_.captured_match() && !flag_.prefix_match()
-      && regex_->min_length() != regex_->max_length()) {
-    Options opt(flag_);
-    opt.reverse(true);
-    opt.prefix_match(true);
-    opt.suffix_match(false);
-    opt.longest_match(true);
-    opt.captured_match(false);
-    reverse_regex_ = new Regex(regex, opt);
+      && regex_->min_length() != regex_->max_length()
+      && !regex_->dfa().SOMAvailable()) {
+    reverse_regex_ = new Regex(regex, ReverseOptions(flag_));
   }
 }
 
@@ -56,6 +94,81 @@ Regen::~Regen()
 {
   delete regex_;
   delete reverse_regex_;
+  delete image_;
+}
+
+/* file image: header, followed by the images of the regex
+   (and of the reverse regex for captured matching). */
+namespace {
+struct ImageHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t regex_offset;
+  uint64_t reverse_offset;
+};
+const char image_magic[8] = {'R', 'E', 'G', 'E', 'N', 'D', 'F', 'A'};
+const uint32_t image_version = 1;
+} // namespace
+
+Regen::Regen(Util::mmap_t *image):
+    regex_(NULL), reverse_regex_(NULL),
+    flag_(Regex::ImageOptions(image->ptr + reinterpret_cast<const ImageHeader*>(image->ptr)->regex_offset)),
+    image_(image)
+{
+  const ImageHeader *header = reinterpret_cast<const ImageHeader*>(image->ptr);
+  regex_ = new Regex(reinterpret_cast<const Regex::Image*>(image->ptr + header->regex_offset));
+  if (header->reverse_offset != 0) {
+    reverse_regex_ = new Regex(reinterpret_cast<const Regex::Image*>(image->ptr + header->reverse_offset));
+  }
+}
+
+bool Regen::Save(const std::string &path) const
+{
+  ImageHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, image_magic, sizeof(header.magic));
+  header.version = image_version;
+
+  std::string image(sizeof(header), 0);
+  header.regex_offset = image.size();
+  if (!regex_->Save(&image)) return false;
+  if (reverse_regex_ != NULL) {
+    image.resize((image.size() + 7) & ~7, 0);
+    header.reverse_offset = image.size();
+    if (!reverse_regex_->Save(&image)) return false;
+  } else if (flag_.captured_match() && !flag_.prefix_match()
+             && regex_->min_length() != regex_->max_length()) {
+    // images have no positions to track the start, save the reverse regex.
+    Regex reverse(regex_->regex(), ReverseOptions(flag_));
+    reverse.Compile(regex_->olevel());
+    image.resize((image.size() + 7) & ~7, 0);
+    header.reverse_offset = image.size();
+    if (!reverse.Save(&image)) return false;
+  }
+  image.replace(0, sizeof(header), reinterpret_cast<const char*>(&header), sizeof(header));
+
+  FILE *fp = fopen(path.c_str(), "wb");
+  if (fp == NULL) return false;
+  bool written = fwrite(image.data(), 1, image.size(), fp) == image.size();
+  return (fclose(fp) == 0) & written;
+}
+
+Regen *Regen::Load(const std::string &path)
+{
+  Util::mmap_t *image = Util::mmap_t::Open(path.c_str());
+  if (image == NULL) return NULL;
+  const ImageHeader *header = reinterpret_cast<const ImageHeader*>(image->ptr);
+  if (image->size < sizeof(ImageHeader)
+      || memcmp(header->magic, image_magic, sizeof(header->magic)) != 0
+      || header->version != image_version
+      || !Regex::ValidImage(image->ptr, image->size, header->regex_offset)
+      || (header->reverse_offset != 0
+          && !Regex::ValidImage(image->ptr, image->size, header->reverse_offset))) {
+    delete image;
+    return NULL;
+  }
+  return new Regen(image);
 }
 
 bool Regen::Compile(Options::CompileFlag olevel)
@@ -70,6 +183,10 @@ bool Regen::Compile(Options::CompileFlag olevel)
 bool Regen::Match(const StringPiece &string, StringPiece *result) const
 {
   if (result != NULL && flag_.captured_match()) {
+    if (reverse_regex_ == NULL && !flag_.suffix_match() && !flag_.prefix_match()
+        && regex_->min_length() != regex_->max_length()) {
+      return regex_->dfa().SOMMatch(string, result);
+    }
     bool match = regex_->Match(string, result);
     if (result->end() != NULL) {
       if (flag_.suffix_match()) {
@@ -89,6 +206,16 @@ bool Regen::Match(const StringPiece &string, StringPiece *result) const
   }
 }
 
+std::size_t Regen::Count(const StringPiece &string) const
+{
+  return regex_->Count(string);
+}
+
+void Regen::MatchMany(const StringPiece *strings, std::size_t n, bool *results) const
+{
+  regex_->MatchMany(strings, n, results);
+}
+
 bool Regen::FullMatch(const StringPiece& string, const StringPiece& pattern, StringPiece *result)
 {
   return FullMatch(string, pattern, DefaultOptions, result);
@@ -7,6 +7,7 @@
 namespace regen {
 
 class Regex;
+namespace Util { struct mmap_t; }
 
 class Regen {
 public:
@@ -46,6 +47,7 @@ public:
       Onone = -1, O0 = 0, O1 = 1, O2 = 2, O3 = 3
     };
     Options(ParseFlag flag = NoParseFlags, const unsigned char delimiter = '\n');
+    ParseFlag parse_flag() const;
     bool shortest_match() const { return shortest_match_; }
     void shortest_match(bool b) { shortest_match_ = b; }
     bool longest_match() const { return !shortest_match(); }
@@ -99,6 +101,27 @@ public:
     bool non_nullable() const { return non_nullable_; }
     void non_nullable(bool b) { non_nullable_ = b; }
     const unsigned char delimiter() const { return delimiter_; }
+    /* memory budget (in bytes) of the on-the-fly DFA cache. */
+    std::size_t cache_size() const { return cache_size_; }
+    void cache_size(std::size_t n) { cache_size_ = n; }
+    /* number of threads used by DFA construction. */
+    std::size_t construct_threads() const { return construct_threads_; }
+    void construct_threads(std::size_t n) { construct_threads_ = n; }
+    /* budget of the DFA construction in Regex::Compile, 0 is unlimited.
+       beyond it, the partial DFA is kept as the on-the-fly DFA cache. */
+    std::size_t state_limit() const { return state_limit_; }
+    void state_limit(std::size_t n) { state_limit_ = n; }
+    std::size_t memory_limit() const { return memory_limit_; }
+    void memory_limit(std::size_t bytes) { memory_limit_ = bytes; }
+    std::size_t time_limit() const { return time_limit_; }
+    void time_limit(std::size_t msec) { time_limit_ = msec; }
+    /* memory budget (in bytes) of the two byte stride table of a DFA,
+       the table is not built beyond it (0 disables it). */
+    std::size_t stride_limit() const { return stride_limit_; }
+    void stride_limit(std::size_t bytes) { stride_limit_ = bytes; }
+    /* directory of the JIT code cache (disabled if empty). */
+    const std::string &jit_cache() const { return jit_cache_; }
+    void jit_cache(const std::string &dir) { jit_cache_ = dir; }
  private:
     bool shortest_match_;
     bool ignore_case_;
@@ -121,6 +144,13 @@ public:
     bool encoding_utf8_;
     bool non_nullable_;
     const unsigned char delimiter_;
+    std::size_t cache_size_;
+    std::size_t construct_threads_;
+    std::size_t state_limit_;
+    std::size_t memory_limit_;
+    std::size_t time_limit_;
+    std::size_t stride_limit_;
+    std::string jit_cache_;
   };
   static const Options DefaultOptions;
   struct Context {
@@ -179,6 +209,10 @@ public:
 
   bool Match(const StringPiece& string, StringPiece* result = NULL) const;
   static bool Match(const StringPiece& string, const Regen& re, StringPiece* result = NULL) { return re.Match(string, result); }
+  /* the number of matching lines (a match skips the rest of its line). */
+  std::size_t Count(const StringPiece& string) const;
+  /* whether each of a batch of (short) strings has a match. */
+  void MatchMany(const StringPiece *strings, std::size_t n, bool *results) const;
   
   static bool FullMatch(const StringPiece& string, const StringPiece& pattern, Options opt, StringPiece *result = NULL);
   static bool FullMatch(const StringPiece& string, const StringPiece& pattern, StringPiece* result = NULL);
@@ -186,15 +220,21 @@ public:
   static bool PartialMatch(const StringPiece &string, const StringPiece& pattern, Options opt, StringPiece *result = NULL);
   static bool PartialMatch(const StringPiece &string, const StringPiece& pattern, StringPiece *result = NULL);
 
+  /* compiled DFAs are saved to (and mapped from) a file, see Save & Load. */
+  bool Save(const std::string &path) const;
+  static Regen *Load(const std::string &path);
+
   bool Consume(const StringPiece& string, StringPiece* result = NULL) const;
   static bool Consume(const StringPiece& string, const Regen& re, StringPiece* result = NULL) { return re.Consume(string, result); }
   static bool Consume(const StringPiece& string, const StringPiece& pattern, StringPiece* result = NULL);
   static bool Consume(const StringPiece& string, const StringPiece& pattern, Options opt, StringPiece* result = NULL);
 
 private:
+  Regen(Util::mmap_t *image);
   Regex *regex_;
   Regex *reverse_regex_;
   Options flag_;
+  Util::mmap_t *image_;
 };
 
 inline Regen::Options::ParseFlag operator|(Regen::Options::ParseFlag a, Regen::Options::ParseFlag b)
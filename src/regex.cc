@@ -15,6 +15,100 @@ Regex::Regex(const Regen::StringPiece& pattern, const Regen::Options flags):
   dfa_.set_expr_info(expr_info_);
 }
 
+Regex::Regex(const Image *header):
+    regex_(reinterpret_cast<const char*>(header) + header->pattern_offset, header->pattern_length),
+    flag_(ImageOptions(reinterpret_cast<const char*>(header))),
+    recursion_depth_(0),
+    involved_char_(std::bitset<256>()),
+    olevel_(Regen::Options::O0),
+    dfa_failure_(false),
+    dfa_(flag_)
+{
+  const char *image = reinterpret_cast<const char*>(header);
+  expr_info_.min_length = header->min_length;
+  expr_info_.max_length = header->max_length;
+  for (std::size_t c = 0; c < 256; c++) {
+    expr_info_.involve[c] = header->involve[c/8] >> (c%8) & 1;
+  }
+  const char *keyword = image + header->keyword_offset;
+  for (std::size_t i = 0; i < header->keyword_num; i++) {
+    uint32_t length;
+    memcpy(&length, keyword, sizeof(length));
+    expr_info_.key.in.insert(std::string(keyword + sizeof(length), length));
+    keyword += sizeof(length) + length;
+  }
+  dfa_.set_expr_info(expr_info_);
+  // the image is checked by ValidImage (Map checks the DFA again).
+  const bool mapped = dfa_.Map(image + header->dfa_offset);
+  assert(mapped);
+  (void)mapped;
+}
+
+Regen::Options Regex::ImageOptions(const char *image)
+{
+  const Image *header = reinterpret_cast<const Image*>(image);
+  return Regen::Options(static_cast<Regen::Options::ParseFlag>(header->parse_flag), header->delimiter);
+}
+
+bool Regex::Save(std::string *image) const
+{
+  if (!dfa_.Complete()) return false;
+  const std::size_t base = image->size();
+  Image header;
+  memset(&header, 0, sizeof(header));
+  header.parse_flag = flag_.parse_flag();
+  header.delimiter = flag_.delimiter();
+  header.min_length = expr_info_.min_length;
+  header.max_length = expr_info_.max_length;
+  for (std::size_t c = 0; c < 256; c++) {
+    header.involve[c/8] |= expr_info_.involve[c] << (c%8);
+  }
+  image->append(sizeof(header), 0);
+
+  header.pattern_offset = image->size() - base;
+  header.pattern_length = regex_.size();
+  image->append(regex_);
+  header.keyword_offset = image->size() - base;
+  header.keyword_num = expr_info_.key.in.size();
+  for (std::set<std::string>::const_iterator iter = expr_info_.key.in.begin();
+       iter != expr_info_.key.in.end(); ++iter) {
+    uint32_t length = iter->size();
+    image->append(reinterpret_cast<const char*>(&length), sizeof(length));
+    image->append(*iter);
+  }
+
+  image->resize(base + ((image->size() - base + 7) & ~7), 0);
+  header.dfa_offset = image->size() - base;
+  if (!dfa_.Save(image)) return false;
+  image->replace(base, sizeof(header), reinterpret_cast<const char*>(&header), sizeof(header));
+  return true;
+}
+
+bool Regex::ValidImage(const char *base, std::size_t size, std::size_t offset)
+{
+  // offsets and lengths are compared with what remains, sums may overflow.
+  if (offset % 8 != 0 || offset > size || sizeof(Image) > size - offset) return false;
+  const Image *header = reinterpret_cast<const Image*>(base + offset);
+  const char *image = base + offset;
+  size -= offset;
+  if (header->pattern_offset > size || header->pattern_length > size - header->pattern_offset
+      || header->keyword_offset > size
+      || header->dfa_offset % 8 != 0
+      || header->dfa_offset > size || sizeof(DFA::Image) > size - header->dfa_offset) return false;
+  // every keyword (a length and its bytes) lies in the image.
+  uint64_t keyword = header->keyword_offset;
+  for (uint64_t i = 0; i < header->keyword_num; i++) {
+    uint32_t length;
+    if (sizeof(length) > size - keyword) return false;
+    memcpy(&length, image + keyword, sizeof(length));
+    keyword += sizeof(length);
+    if (length > size - keyword) return false;
+    keyword += length;
+  }
+  const DFA::Image *dfa = reinterpret_cast<const DFA::Image*>(image + header->dfa_offset);
+  return DFA::ValidImage(dfa, size - header->dfa_offset);
+}
+
 StateExpr* Regex::CombineStateExpr(StateExpr *e1, StateExpr *e2, ExprPool *p)
 {
   StateExpr *s;
@@ -116,7 +210,8 @@ void Regex::Parse()
   if (!flag_.prefix_match()) {
     // rewrite expression R when Prefix-free Matching is required
     // R -> .*?R
-    Expr *dotstar = pool_.alloc<Star>(pool_.alloc<Dot>(true), true);
+    expr_info_.prefix = pool_.alloc<Dot>(true);
+    Expr *dotstar = pool_.alloc<Star>(expr_info_.prefix, true);
     e = pool_.alloc<Concat>(dotstar, e, flag_.reverse_regex());
   }
 
@@ -674,13 +769,15 @@ void Regex::CreateRegexFromDFA(const DFA &dfa, ExprInfo *info, ExprPool *p)
 bool Regex::Compile(Regen::Options::CompileFlag olevel) {
   if (olevel == Regen::Options::Onone || olevel_ >= olevel) return true;
   if (!dfa_failure_ && !dfa_.Complete()) {
-    /* try create DFA.  */
-    std::size_t limit = state_exprs_.size();
-    limit = 1000; // default limitation is 1000 (it's may finish within a second).
+    /* try create DFA within the budget (Options::state_limit etc).  */
+    std::size_t limit = flag_.state_limit();
+    if (limit == 0) limit = std::numeric_limits<std::size_t>::max();
     dfa_failure_ = !dfa_.Construct(limit);
   }
   if (dfa_failure_) {
-    /* can not create DFA. (too many states) */
+    /* can not create DFA (over the budget), match on the fly
+       (with JIT-ed states, if required). */
+    dfa_.Compile(olevel);
     return false;
   }
 
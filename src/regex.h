@@ -18,6 +18,24 @@ namespace regen {
 class Regex {
 public:
   Regex(const Regen::StringPiece& regex, const Regen::Options = Regen::Options::NoParseFlags);
+  /* image of a compiled regex: options, expr_info summary and the DFA,
+     offsets are relative to the image. */
+  struct Image {
+    uint32_t parse_flag;
+    uint32_t delimiter;
+    uint64_t min_length;
+    uint64_t max_length;
+    uint64_t pattern_offset;
+    uint64_t pattern_length;
+    uint64_t keyword_offset;
+    uint64_t keyword_num;
+    uint64_t dfa_offset;
+    unsigned char involve[32];
+  };
+  explicit Regex(const Image *image);
+  bool Save(std::string *image) const;
+  static Regen::Options ImageOptions(const char *image);
+  static bool ValidImage(const char *base, std::size_t size, std::size_t offset);
   ~Regex() {}
   void PrintRegex() const;
   static void PrintRegex(const DFA &);
@@ -28,6 +46,8 @@ public:
   bool Compile(Regen::Options::CompileFlag olevel = Regen::Options::O3);
   bool MinimizeDFA() { if (dfa_.Complete()) { dfa_.Minimize(); return true; } else return false; }
   bool Match(const Regen::StringPiece& string, Regen::StringPiece *result = NULL) const;
+  std::size_t Count(const Regen::StringPiece& string) const { return dfa_.Count(string); }
+  void MatchMany(const Regen::StringPiece *strings, std::size_t n, bool *results) const { dfa_.MatchMany(strings, n, results); }
   bool NFAMatch(const Regen::StringPiece& string, Regen::StringPiece *result = NULL) const;
   const std::string& regex() const { return regex_; }
   std::size_t max_length() const { return expr_info_.max_length; }
@@ -2,13 +2,20 @@
 #include "sfa.h"
 #include <boost/thread.hpp>
 #include <boost/bind.hpp>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace regen {
 
 SFA::SFA(Expr *expr_root, const std::vector<StateExpr*> &state_exprs, std::size_t thread_num):
+    next_task_(0), running_tasks_(0), quit_(false), track_(false),
     nfa_size_(state_exprs.size()),
     dfa_size_(0),
-    thread_num_(thread_num)
+    words_((nfa_size_ + 63) / 64),
+    thread_num_(thread_num),
+    mode_(Eager),
+    cache_size_(0)
 {
   typedef std::set<StateExpr*> NFA;
   fa_accepts_.resize(nfa_size_);
@@ -33,7 +40,7 @@ SFA::SFA(Expr *expr_root, const std::vector<StateExpr*> &state_exprs, std::size_
 
   while (!queue.empty()) {
     sst = queue.front();
-    sst_.push_back(sst);
+    AddMapping(sst);
     queue.pop();
     std::vector<SSTransition> transition(256);
 
@@ -101,17 +108,23 @@ SFA::SFA(Expr *expr_root, const std::vector<StateExpr*> &state_exprs, std::size_
     }
   }
 
+  BuildAcceptEntries();
   complete_ = true;
 }
 
 SFA::SFA(const NFA &nfa, std::size_t thread_num):
+    next_task_(0), running_tasks_(0), quit_(false), track_(false),
     nfa_size_(nfa.size()),
     dfa_size_(0),
-    thread_num_(thread_num)
+    words_((nfa_size_ + 63) / 64),
+    thread_num_(thread_num),
+    mode_(Eager),
+    cache_size_(0)
 {
   fa_accepts_.resize(nfa_size_);
   for (NFA::const_iterator state_iter = nfa.begin(); state_iter != nfa.end(); ++state_iter)
     fa_accepts_[(*state_iter).id] = (*state_iter).accept;
+  start_states_ = nfa.start_states();
 
   SSTransition sst;
   std::map<SSTransition, state_t> sfa_map;
@@ -130,7 +143,7 @@ SFA::SFA(const NFA &nfa, std::size_t thread_num):
 
   while (!queue.empty()) {
     sst = queue.front();
-    sst_.push_back(sst);
+    AddMapping(sst);
     queue.pop();
     std::vector<SSTransition> transition(256);
 
@@ -163,13 +176,20 @@ SFA::SFA(const NFA &nfa, std::size_t thread_num):
     }
   }
 
+  BuildAcceptEntries();
   complete_ = true;
 }
 
-SFA::SFA(const DFA &dfa, std::size_t thread_num):
+SFA::SFA(const DFA &dfa, std::size_t thread_num, Mode mode):
+    DFA(dfa.flag()),
+    next_task_(0), running_tasks_(0), quit_(false), track_(false),
     nfa_size_(0),
     dfa_size_(dfa.size()),
-    thread_num_(thread_num)
+    words_(0),
+    thread_num_(thread_num),
+    mode_(mode),
+    classes_(dfa.alphabet()),
+    cache_size_(dfa.flag().cache_size())
 {
   if (!dfa.Complete()) return;
   
@@ -178,6 +198,21 @@ SFA::SFA(const DFA &dfa, std::size_t thread_num):
     fa_accepts_[s->id] = s->accept;
   }
 
+  if (mode_ != Eager) {
+    // the automaton is the DFA itself (its code runs a chunk from any state).
+    for (std::size_t i = 0; i < dfa_size_; i++) {
+      State &state = get_new_state();
+      const DFA::Transition &trans = dfa.GetTransition(i);
+      for (std::size_t c = 0; c < 256; c++) {
+        state[c] = trans[c];
+        state.dst_states.insert(trans[c]);
+      }
+    }
+    if (mode_ == Lazy) LazyFlush();
+    complete_ = true;
+    return;
+  }
+
   start_states_.insert(0);
   
   SSDTransition ssdt;
@@ -197,11 +232,7 @@ SFA::SFA(const DFA &dfa, std::size_t thread_num):
 
   while (!queue.empty()) {
     ssdt = queue.front();
-    SSTransition sst;
-    for (iter = ssdt.begin(); iter != ssdt.end(); ++iter) {
-      sst[(*iter).first].insert((*iter).second);
-    }
-    sst_.push_back(sst);
+    AddMapping(ssdt);
     queue.pop();
     std::vector<SSDTransition> transition(256);
     
@@ -238,43 +269,610 @@ SFA::SFA(const DFA &dfa, std::size_t thread_num):
     }
   }
 
+  BuildAcceptEntries();
   complete_ = true;
 }
 
-void SFA::MatchTask(TaskArg targ) const
+void SFA::AddMapping(const SSTransition &sst)
 {
+  nfa_maps_.resize(nfa_maps_.size() + nfa_size_ * words_);
+  uint64_t *rows = &nfa_maps_[nfa_maps_.size() - nfa_size_ * words_];
+  for (SSTransition::const_iterator iter = sst.begin(); iter != sst.end(); ++iter) {
+    uint64_t *row = rows + iter->first * words_;
+    for (std::set<state_t>::const_iterator i = iter->second.begin(); i != iter->second.end(); ++i) {
+      row[*i / 64] |= (uint64_t)1 << (*i % 64);
+    }
+  }
+}
 
+void SFA::AddMapping(const SSDTransition &ssdt)
+{
+  dfa_maps_.resize(dfa_maps_.size() + dfa_size_, REJECT);
+  state_t *map = &dfa_maps_[dfa_maps_.size() - dfa_size_];
+  for (SSDTransition::const_iterator iter = ssdt.begin(); iter != ssdt.end(); ++iter) {
+    map[iter->first] = iter->second;
+  }
+}
+
+void SFA::BuildAcceptEntries()
+{
+  std::vector<uint64_t> accepts(words_);
+  for (std::size_t t = 0; t < nfa_size_; t++) {
+    if (fa_accepts_[t]) accepts[t / 64] |= (uint64_t)1 << (t % 64);
+  }
+  accept_begin_.assign(1, 0);
+  accept_entries_.clear();
+  for (std::size_t state = 0; state < size(); state++) {
+    if (dfa_size_ > 0) {
+      const state_t *map = &dfa_maps_[state*dfa_size_];
+      for (std::size_t s = 0; s < dfa_size_; s++) {
+        if (map[s] != REJECT && fa_accepts_[map[s]]) accept_entries_.push_back(s);
+      }
+    } else {
+      const uint64_t *rows = &nfa_maps_[state*nfa_size_*words_];
+      for (std::size_t s = 0; s < nfa_size_; s++) {
+        for (std::size_t w = 0; w < words_; w++) {
+          if ((rows[s*words_+w] & accepts[w]) != 0) {
+            accept_entries_.push_back(s);
+            break;
+          }
+        }
+      }
+    }
+    accept_begin_.push_back(accept_entries_.size());
+  }
+}
+
+/* partition refinement of the SFA (see DFA::Refine), mappings start
+   distinguished by their accepting entries (the sink has none), so two
+   merged mappings take each entry to equivalent states. */
+bool SFA::Minimize()
+{
+  if (!complete_ || mode_ != Eager) return false;
+  if (minimum_) return true;
+  if (olevel_ >= Regen::Options::O1) return false; // native code refers to current states.
+
+  const std::size_t n = size() + 1, sink = size(), k = alphabet_.size;
+
+  std::vector<std::size_t> key(n), blk;
+  std::map<std::vector<state_t>, std::size_t> keys;
+  for (std::size_t s = 0; s < n; s++) {
+    std::vector<state_t> entries;
+    if (s != sink) {
+      entries.assign(accept_entries_.begin() + accept_begin_[s], accept_entries_.begin() + accept_begin_[s+1]);
+    }
+    key[s] = keys.insert(std::make_pair(entries, keys.size())).first->second;
+  }
+  const std::size_t blocks = Refine(key, &blk);
+
+  if (blocks == n) {
+    minimum_ = true;
+    return true;
+  }
+
+  // number blocks by their smallest state (start state remains 0),
+  // the block of the sink becomes REJECT unless it holds the start state.
+  std::vector<state_t> replace_map(blocks, UNDEF);
+  std::vector<state_t> rep;
+  for (std::size_t s = 0; s < n; s++) {
+    std::size_t b = blk[s];
+    if (replace_map[b] != UNDEF) continue;
+    if (b == blk[sink] && s != 0) {
+      replace_map[b] = REJECT;
+    } else {
+      replace_map[b] = rep.size();
+      rep.push_back(s);
+    }
+  }
+
+  // each block keeps the mapping of its representative.
+  std::vector<state_t> transition(rep.size()*k), dfa_maps;
+  std::vector<uint64_t> nfa_maps;
+  std::deque<State> states(rep.size());
+  for (std::size_t i = 0; i < rep.size(); i++) {
+    state_t r = rep[i];
+    State &state = states[i];
+    state.dfa = this;
+    state.id = i;
+    state.alter_transition.next1 = UNDEF;
+    for (std::size_t c = 0; c < k; c++) {
+      state_t next = transition_[r*k+c];
+      if (next != REJECT) next = replace_map[blk[next]];
+      transition[i*k+c] = next;
+      state.dst_states.insert(next);
+    }
+    dfa_maps.insert(dfa_maps.end(), dfa_maps_.begin() + r*dfa_size_, dfa_maps_.begin() + (r+1)*dfa_size_);
+    nfa_maps.insert(nfa_maps.end(), nfa_maps_.begin() + r*nfa_size_*words_, nfa_maps_.begin() + (r+1)*nfa_size_*words_);
+  }
+
+  transition_.swap(transition);
+  states_.swap(states);
+  dfa_maps_.swap(dfa_maps);
+  nfa_maps_.swap(nfa_maps);
+  BuildAcceptEntries();
+
+  minimum_ = true;
+  return true;
+}
+
+SFA::state_t SFA::Run(state_t state, const unsigned char *str, const unsigned char *end) const
+{
   if (olevel_ >= Regen::Options::O1) {
-    partial_results_[targ.task_id] = CompiledMatch(targ.string._udata(), NULL, 0);
+    Regen::StringPiece string(reinterpret_cast<const char*>(str), end - str);
+    return CompiledMatch(string._udata(), NULL, state);
+  }
+  while (str != end && (state = trans(state, *str++)) != DFA::REJECT);
+  return state;
+}
+
+void SFA::MatchTask(TaskArg targ) const
+{
+  if (targ.step != 0) {
+    JoinTask(targ);
+    return;
+  } else if (mode_ == Speculative || (mode_ == Lazy && track_)) {
+    SpeculativeTask(targ);
+    return;
+  } else if (mode_ == Lazy) {
+    LazyTask(targ);
     return;
   }
-  
-  state_t state = 0;
-  const unsigned char* str = targ.string.ubegin(), * end = targ.string.ubegin();
-  
-  while (str != end && (state = transition_[state][*str++]) != DFA::REJECT);
+  if (track_) {
+    TrackTask(targ);
+  } else {
+    partial_results_[targ.task_id] = Run(0, targ.string.ubegin(), targ.string.uend());
+  }
+  ChunkMapping(targ.task_id);
+}
+
+namespace {
+/* an acceptance at p of a group of entries (a run, or a mapping), their
+   earliest acceptance is set by the first one since the group was held,
+   the latest one is given to them when the group is released. */
+template<class Iter>
+void Hold(Iter begin, Iter end, const unsigned char *p, const unsigned char **held, const unsigned char **first)
+{
+  if (*held == NULL) {
+    for (Iter i = begin; i != end; ++i) {
+      if (first[*i] == NULL) first[*i] = p;
+    }
+  }
+  *held = p;
+}
+
+template<class Iter>
+void Release(Iter begin, Iter end, const unsigned char **held, const unsigned char **last)
+{
+  if (*held == NULL) return;
+  for (Iter i = begin; i != end; ++i) last[*i] = *held;
+  *held = NULL;
+}
+
+/* dst |= src over the words of a bit row, two words at once by SSE2. */
+inline void OrRow(uint64_t *dst, const uint64_t *src, std::size_t words)
+{
+  std::size_t k = 0;
+#ifdef __SSE2__
+  for (; k + 2 <= words; k += 2) {
+    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + k));
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + k));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + k), _mm_or_si128(d, s));
+  }
+#endif
+  for (; k < words; k++) dst[k] |= src[k];
+}
+} // namespace
+
+/* the mapping of an eager chunk (its SFA state) is copied to the chunk,
+   the first chunk is entered by the start state(s) only: its entry 0
+   stands for them. */
+void SFA::ChunkMapping(std::size_t chunk) const
+{
+  const state_t state = partial_results_[chunk];
+  if (dfa_size_ > 0) {
+    state_t *map = &chunk_maps_[chunk * dfa_size_];
+    const std::size_t entries = chunk == 0 ? 1 : dfa_size_;
+    if (state == REJECT) {
+      std::fill(map, map + entries, REJECT);
+    } else {
+      std::copy(&dfa_maps_[state * dfa_size_], &dfa_maps_[state * dfa_size_] + entries, map);
+    }
+    return;
+  }
+  uint64_t *rows = &chunk_rows_[chunk * nfa_size_ * words_];
+  if (chunk != 0) {
+    if (state == REJECT) {
+      std::fill(rows, rows + nfa_size_ * words_, 0);
+    } else {
+      std::copy(&nfa_maps_[state * nfa_size_ * words_], &nfa_maps_[(state + 1) * nfa_size_ * words_], rows);
+    }
+    return;
+  }
+  std::vector<uint64_t> row(words_);
+  const unsigned char *first = NULL, *last = NULL;
+  for (std::set<state_t>::const_iterator i = start_states_.begin(); i != start_states_.end(); ++i) {
+    if (state != REJECT) OrRow(&row[0], &nfa_maps_[(state * nfa_size_ + *i) * words_], words_);
+    if (track_ && accept_last_[*i] != NULL) {
+      if (first == NULL || accept_first_[*i] < first) first = accept_first_[*i];
+      if (last < accept_last_[*i]) last = accept_last_[*i];
+    }
+  }
+  std::copy(row.begin(), row.end(), rows);
+  if (track_) {
+    accept_first_[0] = first;
+    accept_last_[0] = last;
+  }
+}
+
+/* the chunk task_id+step (the chunks in between are joined to task_id
+   already) is joined to the chunk task_id: a mapping of each entry, and
+   its earliest and latest acceptance, through both of them. */
+void SFA::JoinTask(TaskArg targ) const
+{
+  const std::size_t n = entry_num(), a = targ.task_id, b = targ.task_id + targ.step;
+  const std::size_t entries = a == 0 ? 1 : n;
+  const unsigned char **first = NULL, **last = NULL, **first_ = NULL, **last_ = NULL;
+  if (track_) {
+    first = &accept_first_[a * n], last = &accept_last_[a * n];
+    first_ = &accept_first_[b * n], last_ = &accept_last_[b * n];
+  }
+  if (dfa_size_ > 0) {
+    state_t *map = &chunk_maps_[a * n];
+    const state_t *map_ = &chunk_maps_[b * n];
+    for (std::size_t s = 0; s < entries; s++) {
+      const state_t t = map[s];
+      if (t == REJECT) continue;
+      if (track_) {
+        if (first[s] == NULL) first[s] = first_[t];
+        if (last_[t] != NULL) last[s] = last_[t];
+      }
+      map[s] = map_[t];
+    }
+    return;
+  }
+  uint64_t *rows = &chunk_rows_[a * n * words_];
+  const uint64_t *rows_ = &chunk_rows_[b * n * words_];
+  std::vector<uint64_t> row(words_);
+  for (std::size_t s = 0; s < entries; s++) {
+    uint64_t *current = rows + s * words_;
+    const unsigned char *f = NULL, *l = NULL;
+    std::fill(row.begin(), row.end(), 0);
+    for (std::size_t w = 0; w < words_; w++) {
+      for (uint64_t bits = current[w], t = w * 64; bits != 0; bits >>= 1, t++) {
+        if ((bits & 1) == 0) continue;
+        OrRow(&row[0], rows_ + t * words_, words_);
+        if (track_ && last_[t] != NULL) {
+          if (f == NULL || first_[t] < f) f = first_[t];
+          if (l < last_[t]) l = last_[t];
+        }
+      }
+    }
+    std::copy(row.begin(), row.end(), current);
+    if (track_) {
+      if (first[s] == NULL) first[s] = f;
+      if (l != NULL) last[s] = l;
+    }
+  }
+}
 
+/* a chunk of the eager SFA, the acceptances of a mapping are given to
+   its accepting entries when the scan enters and leaves the mapping. */
+void SFA::TrackTask(TaskArg targ) const
+{
+  const std::size_t n = entry_num();
+  const unsigned char **first = &accept_first_[targ.task_id * n], **last = &accept_last_[targ.task_id * n];
+  std::fill(first, first + n, (const unsigned char*)NULL);
+  std::fill(last, last + n, (const unsigned char*)NULL);
+  const unsigned char *str = targ.string.ubegin(), *end = targ.string.uend();
+  const unsigned char *held = NULL;
+  state_t state = 0, mapping = REJECT;
+  for (;;) {
+    if (accept_begin_[state] != accept_begin_[state+1]) {
+      if (state != mapping) {
+        if (mapping != REJECT) {
+          Release(&accept_entries_[accept_begin_[mapping]], &accept_entries_[0] + accept_begin_[mapping+1], &held, last);
+        }
+        mapping = state;
+      }
+      Hold(&accept_entries_[accept_begin_[state]], &accept_entries_[0] + accept_begin_[state+1], str, &held, first);
+    }
+    if (str == end || (state = trans(state, *str++)) == REJECT) break;
+  }
+  if (mapping != REJECT) {
+    Release(&accept_entries_[accept_begin_[mapping]], &accept_entries_[0] + accept_begin_[mapping+1], &held, last);
+  }
   partial_results_[targ.task_id] = state;
-  return;
+}
+
+/* a run of the DFA (copied), which records its acceptances. */
+SFA::state_t SFA::TrackedRun(state_t state, const unsigned char *str, const unsigned char *end,
+                             const unsigned char **first, const unsigned char **last) const
+{
+  for (;;) {
+    if (fa_accepts_[state]) {
+      if (*first == NULL) *first = str;
+      *last = str;
+    }
+    if (str == end || (state = trans(state, *str++)) == REJECT) return state;
+  }
+}
+
+void SFA::SpeculativeTask(TaskArg targ) const
+{
+  state_t *map = &chunk_maps_[targ.task_id * dfa_size_];
+  const unsigned char *str = targ.string.ubegin(), *end = targ.string.uend();
+  const unsigned char **first = NULL, **last = NULL;
+  if (track_) {
+    first = &accept_first_[targ.task_id * dfa_size_];
+    last = &accept_last_[targ.task_id * dfa_size_];
+  }
+  if (targ.task_id == 0) {
+    // the first chunk starts from the initial state only.
+    std::fill(map, map + dfa_size_, REJECT);
+    if (track_) {
+      std::fill(first, first + dfa_size_, (const unsigned char*)NULL);
+      std::fill(last, last + dfa_size_, (const unsigned char*)NULL);
+      map[0] = TrackedRun(0, str, end, first, last);
+    } else {
+      map[0] = Run(0, str, end);
+    }
+    return;
+  }
+  Speculate(str, end, map, first, last);
+}
+
+/* map[s]: the state at the end of the string from the state s, and
+   first[s], last[s] (if tracked): the earliest and latest acceptance. */
+void SFA::Speculate(const unsigned char *str, const unsigned char *end, state_t *map,
+                    const unsigned char **first, const unsigned char **last) const
+{
+  std::fill(map, map + dfa_size_, REJECT);
+  const bool track = first != NULL;
+  if (track) {
+    std::fill(first, first + dfa_size_, (const unsigned char*)NULL);
+    std::fill(last, last + dfa_size_, (const unsigned char*)NULL);
+  }
+
+  /* runs[r] is the current state of the start states starts[r], a run
+     which reaches the state of another run is merged into it (both are
+     released first), held[r] is the run's acceptance not released yet. */
+  std::vector<state_t> runs(dfa_size_);
+  std::vector<std::vector<state_t> > starts(dfa_size_);
+  std::vector<std::size_t> owner(dfa_size_), stamp(dfa_size_, 0);
+  std::vector<const unsigned char*> held(track ? dfa_size_ : 0, (const unsigned char*)NULL);
+  for (std::size_t i = 0; i < dfa_size_; i++) {
+    runs[i] = i;
+    starts[i].push_back(i);
+    if (track && fa_accepts_[i]) Hold(starts[i].begin(), starts[i].end(), str, &held[i], first);
+  }
+  std::size_t alive = dfa_size_;
+  for (std::size_t step = 1; str != end && alive > 1; step++) {
+    const unsigned char c = *str++;
+    std::size_t m = 0;
+    for (std::size_t r = 0; r < alive; r++) {
+      const state_t next = trans(runs[r], c);
+      if (next == REJECT) {
+        if (track) Release(starts[r].begin(), starts[r].end(), &held[r], last);
+        starts[r].clear();
+      } else if (stamp[next] == step) {
+        const std::size_t o = owner[next];
+        if (track) {
+          Release(starts[o].begin(), starts[o].end(), &held[o], last);
+          Release(starts[r].begin(), starts[r].end(), &held[r], last);
+        }
+        std::vector<state_t> &merged = starts[o];
+        if (merged.size() < starts[r].size()) merged.swap(starts[r]);
+        merged.insert(merged.end(), starts[r].begin(), starts[r].end());
+        starts[r].clear();
+        if (track && fa_accepts_[next]) Hold(merged.begin(), merged.end(), str, &held[o], first);
+      } else {
+        stamp[next] = step;
+        owner[next] = m;
+        runs[m] = next;
+        if (m != r) {
+          starts[m].swap(starts[r]);
+          if (track) std::swap(held[m], held[r]);
+        }
+        if (track && fa_accepts_[next]) Hold(starts[m].begin(), starts[m].end(), str, &held[m], first);
+        m++;
+      }
+    }
+    alive = m;
+  }
+  for (std::size_t r = 0; r < alive; r++) {
+    // the last run (converged) goes on by the ordinary matching.
+    state_t state = runs[r];
+    if (alive == 1) {
+      if (track) {
+        const unsigned char *f = NULL, *l = NULL;
+        state = TrackedRun(state, str, end, &f, &l);
+        if (l != NULL) {
+          Hold(starts[r].begin(), starts[r].end(), f, &held[r], first);
+          held[r] = l;
+        }
+      } else {
+        state = Run(state, str, end);
+      }
+    }
+    if (track) Release(starts[r].begin(), starts[r].end(), &held[r], last);
+    for (std::size_t i = 0; i < starts[r].size(); i++) map[starts[r][i]] = state;
+  }
+}
+
+/* the lazy mappings are shared by the tasks like the states of the
+   on-the-fly DFA (see DFA::OnTheFlyMatch): transitions are looked up
+   without locks, built under state_lock_, and cache_lock_ is held shared
+   while a task runs (exclusive to flush). */
+void SFA::LazyTask(TaskArg targ) const
+{
+  const std::size_t k = classes_.size;
+  const unsigned char *str = targ.string.ubegin(), *end = targ.string.uend();
+  const unsigned char *flushptr = NULL;
+  state_t state = 0, next = UNDEF;
+  std::vector<state_t> map(dfa_size_);
+  bool fallback = false;
+  cache_lock_.lock_shared();
+  while (str != end) {
+    next = Util::load_acquire(&lazy_next_[state*k+classes_[*str]]);
+    if (next == UNDEF) {
+      state_lock_.lock();
+      while ((next = lazy_next_[state*k+classes_[*str]]) == UNDEF) {
+        const state_t *current = &dfa_maps_[state*dfa_size_];
+        if (!LazyCacheFull()) {
+          for (std::size_t i = 0; i < dfa_size_; i++) {
+            map[i] = current[i] == REJECT ? REJECT : trans(current[i], *str);
+          }
+          next = LazyMapping(map);
+          Util::store_release(&lazy_next_[state*k+classes_[*str]], next);
+          break;
+        }
+        // the current mapping survives the flush (with a new id).
+        map.assign(current, current + dfa_size_);
+        // thrashing: less than 10 bytes were scanned per mapping since the last flush.
+        if (flushptr != NULL && (std::size_t)(str - flushptr) < 10 * lazy_index_.size()) {
+          fallback = true;
+          break;
+        }
+        state_lock_.unlock();
+        std::size_t generation = cache_generation_;
+        cache_lock_.unlock_shared();
+        cache_lock_.lock();
+        if (generation == cache_generation_) {
+          LazyFlush();
+          cache_flushes_++;
+        }
+        state = LazyMapping(map);
+        cache_lock_.unlock_and_lock_shared();
+        flushptr = str;
+        state_lock_.lock();
+      }
+      state_lock_.unlock();
+      if (fallback) break;
+    }
+    if (next == REJECT) break;
+    state = next;
+    str++;
+  }
+  state_t *chunk_map = &chunk_maps_[targ.task_id * dfa_size_];
+  if (fallback) {
+    // the rest is run speculatively, after the current mapping.
+    Speculate(str, end, chunk_map);
+    for (std::size_t i = 0; i < dfa_size_; i++) {
+      map[i] = map[i] == REJECT ? REJECT : chunk_map[map[i]];
+    }
+    std::copy(map.begin(), map.end(), chunk_map);
+  } else if (str != end) {
+    std::fill(chunk_map, chunk_map + dfa_size_, REJECT);
+  } else {
+    state_lock_.lock();
+    std::copy(&dfa_maps_[state*dfa_size_], &dfa_maps_[state*dfa_size_] + dfa_size_, chunk_map);
+    state_lock_.unlock();
+  }
+  cache_lock_.unlock_shared();
+}
+
+SFA::state_t SFA::LazyMapping(const std::vector<state_t> &map) const
+{
+  if (std::count(map.begin(), map.end(), REJECT) == (std::ptrdiff_t)map.size()) return REJECT;
+  std::map<std::vector<state_t>, state_t>::iterator iter = lazy_index_.find(map);
+  if (iter != lazy_index_.end()) return iter->second;
+  const state_t state = lazy_index_.size();
+  lazy_index_.insert(std::make_pair(map, state));
+  dfa_maps_.insert(dfa_maps_.end(), map.begin(), map.end());
+  lazy_next_.resize(lazy_next_.size() + classes_.size, UNDEF);
+  return state;
+}
+
+bool SFA::LazyCacheFull() const
+{
+  // lazy_next_ never grows beyond its reserved capacity (lock free readers).
+  const std::size_t memory = (lazy_next_.size() + 2 * dfa_maps_.size()) * sizeof(state_t);
+  return memory > cache_size_ || lazy_next_.size() + classes_.size > lazy_next_.capacity();
+}
+
+void SFA::LazyFlush() const
+{
+  dfa_maps_.clear();
+  lazy_next_.clear();
+  lazy_index_.clear();
+  cache_generation_++;
+  const std::size_t row = (classes_.size + 2 * dfa_size_) * sizeof(state_t);
+  lazy_next_.reserve((std::min<std::size_t>(cache_size_, 1 << 28) / row + 2) * classes_.size);
+  // the identity mapping is the start of every chunk.
+  std::vector<state_t> identity(dfa_size_);
+  for (std::size_t i = 0; i < dfa_size_; i++) identity[i] = i;
+  LazyMapping(identity);
+}
+
+SFA::~SFA()
+{
+  {
+    boost::lock_guard<boost::mutex> lock(pool_lock_);
+    quit_ = true;
+  }
+  task_ready_.notify_all();
+  workers_.join_all();
+}
+
+void SFA::Worker() const
+{
+  boost::unique_lock<boost::mutex> lock(pool_lock_);
+  for (;;) {
+    while (!quit_ && next_task_ == tasks_.size()) task_ready_.wait(lock);
+    if (quit_) return;
+    RunTask(lock);
+  }
+}
+
+/* publishes tasks_ to the workers, and takes them too until all are done. */
+void SFA::RunTasks(boost::unique_lock<boost::mutex> &lock) const
+{
+  next_task_ = 0;
+  if (tasks_.size() > 1) task_ready_.notify_all();
+  while (RunTask(lock));
+  while (running_tasks_ > 0) task_done_.wait(lock);
+}
+
+/* takes the next task (if any), and runs it out of the lock. */
+bool SFA::RunTask(boost::unique_lock<boost::mutex> &lock) const
+{
+  if (next_task_ == tasks_.size()) return false;
+  TaskArg targ = tasks_[next_task_++];
+  running_tasks_++;
+  lock.unlock();
+  MatchTask(targ);
+  lock.lock();
+  if (--running_tasks_ == 0 && next_task_ == tasks_.size()) task_done_.notify_one();
+  return true;
 }
 
 bool SFA::Match(const Regen::StringPiece &string, Regen::StringPiece *result) const
 {
   if (!complete_) return false;
 
-  std::size_t thread_num = thread_num_;
-  if (string.size() <= 2)  {
-    thread_num = 1;
-  } else if (string.size() < thread_num) {
-    thread_num = string.size();
-  }
+  boost::lock_guard<boost::mutex> match_lock(match_lock_);
+  std::size_t thread_num = std::min(thread_num_, string.size() / min_task_size);
+  if (thread_num == 0) thread_num = 1;
   partial_results_.resize(thread_num);
-  boost::thread *threads[thread_num];
+  // a partial match may end before the string does (even without a result).
+  track_ = (result != NULL || !flag_.suffix_match()) && !flag_.reverse_match();
+  if (track_) {
+    accept_first_.resize(thread_num * entry_num());
+    accept_last_.resize(thread_num * entry_num());
+  }
+  if (dfa_size_ > 0) {
+    chunk_maps_.resize(thread_num * dfa_size_);
+  } else {
+    chunk_rows_.resize(thread_num * nfa_size_ * words_);
+  }
   std::size_t task_string_length = string.size() / thread_num;
   std::size_t remainder_length = string.size() % thread_num;
   TaskArg targ;
+  targ.step = 0;
   const char *str = string.begin();
 
+  boost::unique_lock<boost::mutex> lock(pool_lock_);
+  tasks_.clear();
   for (std::size_t i = 0; i < thread_num; i++) {
     if (i == thread_num - 1) task_string_length += remainder_length;
     targ.string.set(str, task_string_length);
@@ -283,47 +881,49 @@ bool SFA::Match(const Regen::StringPiece &string, Regen::StringPiece *result) co
     } else {
       targ.task_id = i;
     }
-    threads[targ.task_id] = new boost::thread(
-        boost::bind(
-            boost::bind(&regen::SFA::MatchTask, this, _1),
-            targ));
+    tasks_.push_back(targ);
     str += task_string_length;
   }
-
-  std::set<state_t> states, next_states;
-  states = start_states_;
-  state_t pstate;
-
-  for (std::size_t i = 0; i < thread_num; i++) {
-    threads[i]->join();
-    if ((pstate = partial_results_[i]) == DFA::REJECT) {
-      states.clear();
-      break;
-    }
-    for (std::set<state_t>::iterator i = states.begin(); i != states.end(); ++i) {
-      SSTransition::const_iterator iter = sst_[pstate].find(*i);
-      if (iter == sst_[pstate].end()) continue;
-      next_states.insert((*iter).second.begin(), (*iter).second.end());
+  for (std::size_t i = workers_.size(); i + 1 < thread_num; i++) {
+    workers_.create_thread(boost::bind(&regen::SFA::Worker, this));
+  }
+  RunTasks(lock);
+  /* the chunks are joined in pairs, a level of joins (run by the
+     workers) halves them, so the join is log2(thread_num) compositions
+     deep. chunk 0 keeps the start state(s) only, a join to it is a
+     lookup (DFA) or an OR of rows (NFA) of its entry. */
+  targ.string.clear();
+  for (targ.step = 1; targ.step < thread_num; targ.step *= 2) {
+    tasks_.clear();
+    for (targ.task_id = 0; targ.task_id + targ.step < thread_num; targ.task_id += 2 * targ.step) {
+      tasks_.push_back(targ);
     }
-    states.swap(next_states);
-    if (states.empty()) break;
-    next_states.clear();
+    RunTasks(lock);
   }
+  lock.unlock();
 
+  // the acceptances (if tracked) of the start entry are the string's.
   bool match = false;
-  for (std::set<state_t>::iterator i = states.begin(); i != states.end(); ++i) {
-    if (fa_accepts_[*i]) {
-      match = true;
-      break;
+  const unsigned char *matchptr = NULL;
+  if (dfa_size_ > 0) {
+    const state_t state = chunk_maps_[0];
+    match = state != REJECT && fa_accepts_[state];
+  } else {
+    for (std::size_t s = 0; s < nfa_size_ && !match; s++) {
+      match = (chunk_rows_[s / 64] >> (s % 64) & 1) && fa_accepts_[s];
     }
   }
-
-  for (std::size_t i = 0; i < thread_num; i++) {
-    threads[i]->join();
-    delete threads[i];
+  if (track_ && accept_last_[0] != NULL) {
+    // shortest matching is decided by the first acceptance.
+    if (flag_.shortest_match() && !flag_.suffix_match()) {
+      matchptr = accept_first_[0];
+      match = false;
+    } else {
+      matchptr = accept_last_[0];
+    }
   }
-  
-  return match;
+
+  return track_ ? SetResult(string, match, matchptr, result) : match;
 }
 
 } // namespace regen
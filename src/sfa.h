@@ -7,6 +7,7 @@
 #include "expr.h"
 #include "nfa.h"
 #include "dfa.h"
+#include <boost/thread.hpp>
 
 class Regex;
 
@@ -16,26 +17,101 @@ class SFA: public DFA {
 public:
   SFA(Expr* expr_root, const std::vector<StateExpr*> &state_exprs, std::size_t thread_num = 2);
   SFA(const NFA &nfa, std::size_t thread_num = 2);  
-  SFA(const DFA &dfa, std::size_t thread_num = 2);
+  /* Eager: the whole simultaneous automaton is built here.
+     Speculative: none is built, a chunk is run from every DFA state at
+     once (runs which reach the same state are merged, most of them soon),
+     and the chunks' results are chained.
+     Lazy: the mappings are built on the fly (shared by the workers), for
+     the bytes the chunks meet, in a cache bounded by the DFA's cache_size. */
+  enum Mode { Eager, Speculative, Lazy };
+  SFA(const DFA &dfa, std::size_t thread_num = 2, Mode mode = Eager);
+  ~SFA();
   std::size_t thread_num() const { return thread_num_; }
   void thread_num(std::size_t thread_num) { thread_num_ = thread_num; }
   typedef std::map<state_t, std::set<state_t> > SSTransition;
   typedef std::map<state_t, state_t> SSDTransition;
-  bool Minimize() { return true; }
+  /* merges the mappings which accept the same strings from every entry
+     state (eager SFAs only, before Compile). */
+  bool Minimize();
+  /* with a result or for a partial match (forward matching), the chunks
+     also record the earliest and latest acceptance from each entry
+     state, and are chained like their mappings: result->end() is the
+     latest acceptance before the matching is rejected (the earliest one
+     for shortest matching), as DFA::Match reports. such chunks are
+     scanned by the tables (the lazy ones speculatively), not by the
+     JITed code. */
   bool Match(const Regen::StringPiece& string, Regen::StringPiece* result = NULL) const;
   struct TaskArg {
     Regen::StringPiece string;
     std::size_t task_id;
+    std::size_t step; // a join of the chunk task_id+step to task_id (0: a scan).
   };
+  /* a string is split into tasks of at least min_task_size bytes (at
+     most thread_num tasks), a shorter one is matched by the caller. */
+  enum { min_task_size = 32 * 1024 };
 private:
   void MatchTask(TaskArg targ) const;
+  void ChunkMapping(std::size_t chunk) const;
+  void JoinTask(TaskArg targ) const;
+  void TrackTask(TaskArg targ) const;
+  void SpeculativeTask(TaskArg targ) const;
+  void Speculate(const unsigned char *str, const unsigned char *end, state_t *map,
+                 const unsigned char **first = NULL, const unsigned char **last = NULL) const;
+  state_t TrackedRun(state_t state, const unsigned char *str, const unsigned char *end,
+                     const unsigned char **first, const unsigned char **last) const;
+  void LazyTask(TaskArg targ) const;
+  state_t LazyMapping(const std::vector<state_t> &map) const;
+  bool LazyCacheFull() const;
+  void LazyFlush() const;
+  state_t Run(state_t state, const unsigned char *str, const unsigned char *end) const;
+  /* the workers (thread_num-1 of them) persist across Match calls,
+     they are started by the first Match which needs them. a call
+     publishes its tasks, then the caller and the workers take them
+     one by one until none is left. */
+  void Worker() const;
+  void RunTasks(boost::unique_lock<boost::mutex> &lock) const;
+  bool RunTask(boost::unique_lock<boost::mutex> &lock) const;
+  mutable boost::thread_group workers_;
+  mutable boost::mutex pool_lock_;
+  mutable boost::condition_variable task_ready_, task_done_;
+  mutable std::vector<TaskArg> tasks_;
+  mutable std::size_t next_task_, running_tasks_;
+  mutable bool quit_;
+  mutable boost::mutex match_lock_; // serializes Match calls.
   mutable std::vector<state_t> partial_results_;
+  /* acceptance tracking (see Match): the earliest and latest acceptance
+     (NULL: none) of a chunk from each entry state (a DFA or NFA state),
+     per chunk. */
+  std::size_t entry_num() const { return dfa_size_ > 0 ? dfa_size_ : nfa_size_; }
+  mutable bool track_;
+  mutable std::vector<const unsigned char*> accept_first_, accept_last_;
+  /* the accepting entries of a mapping (an eager SFA state) are
+     accept_entries_[accept_begin_[state], accept_begin_[state+1]). */
+  void BuildAcceptEntries();
+  std::vector<std::size_t> accept_begin_;
+  std::vector<state_t> accept_entries_;
+  /* mappings (the states at the end of a chunk from each state at its
+     start) are dense: a DFA state per DFA state (REJECT: none), or a row
+     of bits (NFA states) per NFA state. */
+  void AddMapping(const SSTransition &sst);
+  void AddMapping(const SSDTransition &ssdt);
   std::size_t nfa_size_;
   std::size_t dfa_size_;
+  std::size_t words_; // 64 bit words of a row.
   std::set<state_t> start_states_;
   std::size_t thread_num_;
   std::vector<bool> fa_accepts_;
-  std::vector<SSTransition> sst_;
+  mutable std::vector<state_t> dfa_maps_;
+  std::vector<uint64_t> nfa_maps_;
+  Mode mode_;
+  mutable std::vector<state_t> chunk_maps_; // a DFA state per DFA state, per chunk.
+  mutable std::vector<uint64_t> chunk_rows_; // a bit row per NFA state, per chunk.
+  /* lazy mappings: dfa_maps_ (a row per mapping), its transitions (by the
+     DFA's byte classes, UNDEF: not built yet) and its index. */
+  Alphabet classes_;
+  std::size_t cache_size_;
+  mutable std::vector<state_t> lazy_next_;
+  mutable std::map<std::vector<state_t>, state_t> lazy_index_;
 };
 
 } // namespace regen
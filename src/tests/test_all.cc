@@ -1,5 +1,12 @@
 #include "gtest/gtest.h"
 #include "../regen.h"
+#include "../regex.h"
+#include "../generator.h"
+#include <dirent.h>
+#ifdef REGEN_ENABLE_PARALLEL
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#endif
 
 struct testcase {
   testcase(std::string regex_, std::string text_, bool result_): regex(regex_), text(text_), result(result_) {}
@@ -123,8 +130,803 @@ testcase test[] = {
       ASSERT_EQ(r.Match(test[i].text), test[i].result);             \
     }                                                               \
   }
+GENTEST(Onone)
 GENTEST(O0)
 GENTEST(O1)
 GENTEST(O2)
 GENTEST(O3)
 #undef GENTEST
+
+/* texts of random letters (shorter than max), the same for a seed,
+   followed by the edge texts (a NULL terminated list) if any. */
+static std::vector<std::string> RandomTexts(unsigned int seed, std::size_t num, std::size_t max, const char *letters,
+                                            const char *const *edge = NULL)
+{
+  const std::size_t n = strlen(letters);
+  std::vector<std::string> texts(num);
+  srand(seed);
+  for (std::size_t i = 0; i < num; i++) {
+    for (std::size_t j = rand() % max; j > 0; j--) texts[i] += letters[rand() % n];
+  }
+  for (; edge != NULL && *edge != NULL; edge++) texts.push_back(*edge);
+  return texts;
+}
+
+static long Offset(const Regen::StringPiece &text, const char *p)
+{
+  return p == NULL ? -1 : p - text.begin();
+}
+
+static std::string Excerpt(const Regen::StringPiece &text)
+{
+  if (text.size() <= 64) return "\"" + std::string(text.begin(), text.end()) + "\"";
+  return "\"" + std::string(text.begin(), 64) + "\"...";
+}
+
+/* a variant (other options, olevel or engine) matches a text as the
+   reference does, with the result (its begin and end) and without it,
+   and either one answers the same with or without the result. */
+template<class Reference, class Variant>
+::testing::AssertionResult SameMatch(const Reference &ref, const Variant &r, const Regen::StringPiece &text)
+{
+  Regen::StringPiece expected, result;
+  const bool match = ref.Match(text, &expected), match_ = r.Match(text, &result);
+  if (match != match_ || expected.begin() != result.begin() || expected.end() != result.end()) {
+    return ::testing::AssertionFailure() << Excerpt(text) << ": "
+        << match << " [" << Offset(text, expected.begin()) << ", " << Offset(text, expected.end()) << ") expected, "
+        << match_ << " [" << Offset(text, result.begin()) << ", " << Offset(text, result.end()) << ") actual";
+  }
+  const bool expected_ = ref.Match(text), actual_ = r.Match(text);
+  if (expected_ != match || actual_ != match_) {
+    return ::testing::AssertionFailure() << Excerpt(text) << ": "
+        << expected_ << " (" << match << " with the result) expected, "
+        << actual_ << " (" << match_ << " with the result) actual without the result";
+  }
+  return ::testing::AssertionSuccess();
+}
+
+/* SameMatch for each of the texts, the first failure is reported. */
+template<class Reference, class Variant>
+::testing::AssertionResult SameMatches(const Reference &ref, const Variant &r, const std::vector<std::string> &texts)
+{
+  for (std::size_t i = 0; i < texts.size(); i++) {
+    ::testing::AssertionResult same = SameMatch(ref, r, texts[i]);
+    if (!same) return same;
+  }
+  return ::testing::AssertionSuccess();
+}
+
+/* a fresh directory for the files of a test, removed (with its
+   files) when the test returns, also by a failed assertion. */
+struct TempDir {
+  TempDir() {
+    char templ[] = "/tmp/regen_test.XXXXXX";
+    if (mkdtemp(templ) != NULL) path = templ;
+  }
+  ~TempDir() {
+    if (path.empty()) return;
+    DIR *dir = opendir(path.c_str());
+    for (struct dirent *e; dir != NULL && (e = readdir(dir)) != NULL;) {
+      if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0) unlink((path + "/" + e->d_name).c_str());
+    }
+    if (dir != NULL) closedir(dir);
+    rmdir(path.c_str());
+  }
+  std::string path;
+};
+
+TEST(DFATest, Alphabet) {
+  regen::Regex r("[a-z]+[0-9]x");
+  r.Compile(Regen::Options::O0);
+  // [a-wyz], x, [0-9], delimiter and the rest.
+  ASSERT_EQ(r.dfa().alphabet().size, 5u);
+  ASSERT_EQ(r.dfa().alphabet()['a'], r.dfa().alphabet()['z']);
+  ASSERT_NE(r.dfa().alphabet()['a'], r.dfa().alphabet()['x']);
+  ASSERT_TRUE(r.Match("ab1x"));
+  ASSERT_FALSE(r.Match("ab1y"));
+}
+
+TEST(DFATest, Minimize) {
+  const std::size_t TESTNUM = sizeof(test) / sizeof(testcase);
+  for (std::size_t i = 0; i < TESTNUM; i++) {
+    regen::Regex r(test[i].regex);
+    r.Compile(Regen::Options::O0);
+    r.MinimizeDFA();
+    r.Compile(Regen::Options::O3);
+    ASSERT_EQ(r.Match(test[i].text), test[i].result);
+  }
+  regen::Regex r("abd|a(b|c)d|a[bc]d");
+  r.Compile(Regen::Options::O0);
+  r.MinimizeDFA();
+  ASSERT_EQ(r.dfa().size(), 4u);
+}
+
+TEST(DFATest, LazyCache) {
+  // the DFA of this expression has 2^11 states.
+  Regen::Options opt;
+  opt.cache_size(1 << 16);
+  regen::Regex r("(a|b)*a(a|b){10}", opt);
+  std::string text;
+  srand(0);
+  for (std::size_t i = 0; i < 20000; i++) text += "ab"[rand() % 2];
+  text += "abbbbbbbbbb";
+  ASSERT_TRUE(r.Match(text));
+  ASSERT_GT(r.dfa().cache_flushes(), 0u);
+  ASSERT_FALSE(r.Match(text + "a"));
+  opt.cache_size(0);
+  regen::Regex r2("(a|b)*a(a|b){10}", opt);
+  ASSERT_TRUE(r2.Match(text));
+  ASSERT_GT(r2.dfa().nfa_fallbacks(), 0u);
+  // a partial DFA larger than the cache is kept through the first miss.
+  opt.cache_size(1 << 12);
+  opt.state_limit(1000);
+  regen::Regex r3("(a|b)*a(a|b){10}", opt);
+  ASSERT_FALSE(r3.Compile(Regen::Options::O0));
+  ASSERT_TRUE(r3.Match("aaaaaaaaaaa"));
+  ASSERT_GT(r3.dfa().size(), 1000u);
+  ASSERT_EQ(r3.dfa().cache_flushes(), 0u);
+  // a full match accepts the whole string, not a prefix of it.
+  const char *regex[] = {"((a|b)*a(a|b){12})?", "(abc)*", 0};
+  std::vector<std::string> texts = RandomTexts(6, 200, 40, "abc");
+  texts.push_back("b");
+  texts.push_back("ab");
+  texts.push_back("abcab");
+  for (std::size_t i = 0; regex[i] != NULL; i++) {
+    Regen::Options opt;
+    opt.state_limit(0);
+    regen::Regex ref(regex[i], opt);
+    ASSERT_TRUE(ref.Compile(Regen::Options::O0));
+    opt.state_limit(2);
+    regen::Regex r(regex[i], opt);
+    ASSERT_FALSE(r.Compile(Regen::Options::O0));
+    ASSERT_TRUE(SameMatches(ref, r, texts)) << regex[i];
+    Regen::StringPiece result;
+    ASSERT_FALSE(r.Match(i == 0 ? "b" : "ab", &result)) << regex[i];
+  }
+}
+
+TEST(DFATest, ConstructBudget) {
+  Regen::Options opt;
+  opt.partial_match(true);
+  opt.state_limit(0);
+  regen::Regex ref("(a|b)*a(a|b){8}c", opt);
+  ASSERT_TRUE(ref.Compile(Regen::Options::O0));
+  opt.state_limit(100);
+  regen::Regex r1("(a|b)*a(a|b){8}c", opt);
+  ASSERT_FALSE(r1.Compile(Regen::Options::O0));
+  ASSERT_GE(r1.dfa().size(), 100u); // partial DFA is kept.
+  opt.state_limit(0);
+  opt.memory_limit(1 << 16);
+  regen::Regex r2("(a|b)*a(a|b){8}c", opt);
+  ASSERT_FALSE(r2.Compile(Regen::Options::O0));
+  ASSERT_GT(r2.dfa().size(), 0u);
+  srand(4);
+  for (std::size_t i = 0; i < 200; i++) {
+    std::string text;
+    for (std::size_t j = rand() % 40; j > 0; j--) text += "abc"[rand() % 3];
+    Regen::StringPiece result, result1, result2;
+    bool match = ref.Match(text, &result);
+    ASSERT_EQ(r1.Match(text, &result1), match);
+    ASSERT_EQ(r2.Match(text, &result2), match);
+    ASSERT_EQ(result1.end(), result.end());
+    ASSERT_EQ(result2.end(), result.end());
+  }
+  ASSERT_EQ(r1.dfa().cache_flushes(), 0u);
+}
+
+#ifdef REGEN_ENABLE_JIT
+TEST(DFATest, LazyJIT) {
+  const char *regex[] = {"(a|b)*a(a|b){8}c", "x(ab|cd)*e", "e.*?x", "[^\\n]*x$", 0};
+  // the empty text, a match at either end, or ended by the delimiter.
+  const char *edge[] = {"", "x", "xe", "ex", "xabcde", "x\n", "\nx", "aaaaaaaaac", "baaaaaaaaacx", 0};
+  std::vector<std::string> texts = RandomTexts(13, 200, 60, "abcdex\n", edge);
+  for (std::size_t i = 0; regex[i] != NULL; i++) {
+    for (std::size_t n = 0; n < 3; n++) { // partial, reverse and flushed cache.
+      Regen::Options opt;
+      opt.partial_match(true);
+      opt.reverse_match(n == 1);
+      opt.state_limit(0);
+      regen::Regex ref(regex[i], opt);
+      ASSERT_TRUE(ref.Compile(Regen::Options::O0));
+      opt.state_limit(4);
+      if (n == 2) opt.cache_size(1);
+      regen::Regex r(regex[i], opt);
+      ASSERT_FALSE(r.Compile(Regen::Options::O1));
+      ASSERT_EQ(r.dfa().olevel(), Regen::Options::O1);
+      ASSERT_TRUE(SameMatches(ref, r, texts)) << regex[i];
+    }
+  }
+}
+#endif
+
+TEST(DFATest, TableWidth) {
+  regen::Regex r1("(a|b)*a(a|b)");
+  r1.Compile(Regen::Options::O0);
+  ASSERT_EQ(r1.dfa().table_width(), 1u);
+  Regen::Options opt;
+  opt.partial_match(true);
+  regen::Regex r2("(a|b)*a(a|b){8}c", opt);
+  regen::Regex r3("(a|b)*a(a|b){8}c", opt);
+  r2.Compile(Regen::Options::O0);
+  r3.Compile(Regen::Options::O3);
+  ASSERT_EQ(r2.dfa().table_width(), 2u);
+  srand(2);
+  for (std::size_t i = 0; i < 200; i++) {
+    std::string text;
+    for (std::size_t j = rand() % 40; j > 0; j--) text += "abc"[rand() % 3];
+    Regen::StringPiece result2, result3;
+    ASSERT_EQ(r2.Match(text, &result2), r3.Match(text, &result3));
+    ASSERT_EQ(result2.end(), result3.end());
+  }
+}
+
+TEST(DFATest, ParallelConstruct) {
+  const char *regex[] = {"(a|b)*a(a|b){8}", "[a-z]*(abc|bcd|e[f-k]+)[0-9]{3}", ".*a.{6}b", 0};
+  for (std::size_t i = 0; regex[i] != NULL; i++) {
+    Regen::Options opt;
+    regen::Regex r1(regex[i], opt);
+    opt.construct_threads(4);
+    regen::Regex r4(regex[i], opt);
+    r1.Compile(Regen::Options::O0);
+    r4.Compile(Regen::Options::O0);
+    const regen::DFA &d1 = r1.dfa(), &d4 = r4.dfa();
+    ASSERT_EQ(d1.size(), d4.size());
+    for (std::size_t s = 0; s < d1.size(); s++) {
+      ASSERT_EQ(d1.IsAcceptState(s), d4.IsAcceptState(s));
+      for (std::size_t c = 0; c < 256; c++) ASSERT_EQ(d1[s][c], d4[s][c]);
+    }
+  }
+}
+
+TEST(DFATest, StrideTable) {
+  const char *regex[] = {"(a|b)*a(a|b){3}c", "x(ab|cd)*e", "e.*?x", "ab*bc", "a(bc)*", 0};
+  // odd lengths (a last single byte), and acceptances at the byte
+  // between the two of a stride.
+  const char *edge[] = {"", "e", "ex", "xe", "xcde", "xcdex", "dxabe", "abc", "abcx", "eabbcx", "aaaac", "baaaac", "abcbx", 0};
+  std::vector<std::string> texts = RandomTexts(15, 100, 60, "abcdex\n", edge);
+  for (std::size_t i = 0; regex[i] != NULL; i++) {
+    for (std::size_t n = 0; n < 3; n++) { // partial, longest and reverse.
+      Regen::Options opt;
+      opt.partial_match(true);
+      opt.longest_match(n == 1);
+      opt.reverse_match(n == 2);
+      opt.stride_limit(0);
+      regen::Regex ref(regex[i], opt);
+      ref.Compile(Regen::Options::O0);
+      ASSERT_FALSE(ref.dfa().HasStrideTable());
+      opt.stride_limit(1 << 20);
+      regen::Regex r0(regex[i], opt), r1(regex[i], opt);
+      r0.Compile(Regen::Options::O0);
+      r1.Compile(Regen::Options::O1);
+      ASSERT_TRUE(r0.dfa().HasStrideTable());
+      ASSERT_TRUE(SameMatches(ref, r0, texts)) << regex[i];
+      ASSERT_TRUE(SameMatches(ref, r1, texts)) << regex[i];
+    }
+  }
+}
+
+/* the start of a match found backwards from its end (by a longest
+   prefix match of the reverse regex), as Regen did without SOMMatch. */
+struct BackwardStart {
+  BackwardStart(const regen::Regex &forward, const regen::Regex &backward): forward(forward), backward(backward) {}
+  bool Match(const Regen::StringPiece &text, Regen::StringPiece *result = NULL) const {
+    const bool match = forward.Match(text, result);
+    if (match && result != NULL && result->end() != NULL) {
+      backward.Match(Regen::StringPiece(text.begin(), result->end()), result);
+    }
+    return match;
+  }
+  const regen::Regex &forward, &backward;
+};
+
+struct ForwardStart {
+  explicit ForwardStart(const regen::DFA &dfa): dfa(dfa) {}
+  bool Match(const Regen::StringPiece &text, Regen::StringPiece *result = NULL) const {
+    return dfa.SOMMatch(text, result);
+  }
+  const regen::DFA &dfa;
+};
+
+TEST(DFATest, StartOfMatch) {
+  const char *regex[] = {"ab+bc", "(a|ab)(c|bcd)(d*)", "ab|b+c", "(a|b)*a(a|b){3}", "x(ab|cd)*e", "[a-c]+x",
+                         "(a|abcd)x*", "(abc|b)(e|cde)", 0};
+  // matches of alternatives of different lengths, overlapping ones.
+  const char *edge[] = {"", "abcdx", "aabcdxx", "abcde", "bcde", "abce", "abbbc", "babbc", "ab\nbc", 0};
+  std::vector<std::string> texts = RandomTexts(17, 200, 60, "abcdex\n", edge);
+  for (std::size_t i = 0; regex[i] != NULL; i++) {
+    for (std::size_t n = 0; n < 3; n++) { // longest, shortest and flushed cache.
+      Regen::Options opt;
+      opt.partial_match(true);
+      opt.captured_match(true);
+      opt.shortest_match(n == 1);
+      if (n == 2) opt.cache_size(1);
+      Regen r(regex[i], opt);
+      ASSERT_TRUE(r.Compile(Regen::Options::O1));
+      regen::Regex som(regex[i], opt);
+      som.Compile(Regen::Options::O1);
+      regen::Regex ref(regex[i], opt);
+      ref.Compile(Regen::Options::O0);
+      opt.reverse(true);
+      opt.prefix_match(true);
+      opt.longest_match(true);
+      regen::Regex reverse(regex[i], opt);
+      reverse.Compile(Regen::Options::O0);
+      const BackwardStart backward(ref, reverse);
+      ASSERT_TRUE(SameMatches(backward, r, texts)) << regex[i];
+      ASSERT_TRUE(SameMatches(backward, ForwardStart(som.dfa()), texts)) << regex[i];
+    }
+  }
+}
+
+TEST(DFATest, Count) {
+  const char *regex[] = {"ab+c", "^a*$", "b$", "(a|b)*a(a|b){2}", "^$", 0};
+  // empty texts and lines, a last line with or without the delimiter.
+  const char *edge[] = {"", "\n", "\n\n", "abc", "abc\n", "\nabc", "b\nb", "b\nb\n", "b\nb\nb\nb\n", "aaa\n\naab", 0};
+  std::vector<std::string> texts = RandomTexts(19, 200, 100, "abc\n", edge);
+  for (std::size_t i = 0; regex[i] != NULL; i++) {
+    Regen::Options opt;
+    opt.partial_match(true);
+    opt.shortest_match(true);
+    Regen r(regex[i], opt), ref(regex[i], opt);
+    ASSERT_TRUE(r.Compile(Regen::Options::O2));
+    ref.Compile(Regen::Options::O0);
+    for (std::size_t j = 0; j < texts.size(); j++) {
+      const std::string &text = texts[j];
+      // reference: one Match per line (none after a last delimiter).
+      std::size_t count = 0;
+      for (std::size_t begin = 0; begin == 0 || begin < text.size();) {
+        std::size_t end = std::min(text.find('\n', begin), text.size());
+        if (ref.Match(Regen::StringPiece(text.data() + begin, text.data() + end))) count++;
+        begin = end + 1;
+      }
+      ASSERT_EQ(count, r.Count(text)) << regex[i] << " " << Excerpt(text);
+      ASSERT_EQ(count, ref.Count(text)) << regex[i] << " " << Excerpt(text);
+    }
+  }
+}
+
+TEST(DFATest, MatchMany) {
+  const char *regex[] = {"ab+c", "^a*$", "b$", "(a|b)*a(a|b){2}", "c.*a", 0};
+  // mostly short strings, a long one now and then holds its lane.
+  std::vector<std::string> texts = RandomTexts(23, 101, 60, "abc\n");
+  for (std::size_t j = 0; j < texts.size(); j++) {
+    if (j % 7 != 0) texts[j].resize(texts[j].size() % 8);
+  }
+  std::vector<Regen::StringPiece> strings(texts.begin(), texts.end());
+  for (std::size_t i = 0; regex[i] != NULL; i++) {
+    for (std::size_t n = 0; n < 4; n++) { // full/partial, longest/shortest.
+      Regen::Options opt;
+      opt.partial_match(n & 1);
+      opt.shortest_match(n & 2);
+      regen::Regex r(regex[i], opt);
+      ASSERT_TRUE(r.Compile(Regen::Options::O0));
+      bool results[101];
+      r.MatchMany(&strings[0], strings.size(), results);
+      for (std::size_t j = 0; j < strings.size(); j++) ASSERT_EQ(r.Match(strings[j]), results[j]) << regex[i];
+      // batches with fewer strings than lanes.
+      for (std::size_t m = 0; m < 6; m++) {
+        r.MatchMany(&strings[1], m, results);
+        for (std::size_t j = 0; j < m; j++) ASSERT_EQ(r.Match(strings[j+1]), results[j]) << regex[i];
+      }
+    }
+  }
+}
+
+TEST(DFATest, SaveLoad) {
+  const std::size_t TESTNUM = sizeof(test) / sizeof(testcase);
+  TempDir tmp;
+  ASSERT_FALSE(tmp.path.empty());
+  const std::string path = tmp.path + "/image";
+  for (std::size_t i = 0; i < TESTNUM; i++) {
+    Regen r(test[i].regex);
+    r.Compile(Regen::Options::O0);
+    ASSERT_TRUE(r.Save(path));
+    Regen *l = Regen::Load(path);
+    ASSERT_TRUE(l != NULL);
+    ASSERT_EQ(l->Match(test[i].text), test[i].result);
+    delete l;
+  }
+  Regen::Options opt;
+  opt.partial_match(true);
+  Regen r("(a|b)*a(a|b){8}c", opt);
+  r.Compile(Regen::Options::O0);
+  ASSERT_FALSE(r.Save(path)); // too many states to be completed.
+  opt.captured_match(true);
+  Regen r2("[a-z]+[0-9]x|abc", opt);
+  r2.Compile(Regen::Options::O0);
+  ASSERT_TRUE(r2.Save(path));
+  Regen *l = Regen::Load(path);
+  ASSERT_TRUE(l != NULL);
+  srand(3);
+  for (std::size_t i = 0; i < 200; i++) {
+    std::string text;
+    for (std::size_t j = rand() % 40; j > 0; j--) text += "abcx1"[rand() % 5];
+    Regen::StringPiece result1, result2;
+    ASSERT_EQ(r2.Match(text, &result1), l->Match(text, &result2));
+    ASSERT_EQ(result1.begin(), result2.begin());
+    ASSERT_EQ(result1.end(), result2.end());
+  }
+  delete l;
+  // a loaded image answers as the original, also for a full match.
+  Regen r3(".a*");
+  r3.Compile(Regen::Options::O2);
+  ASSERT_TRUE(r3.Save(path));
+  l = Regen::Load(path);
+  ASSERT_TRUE(l != NULL);
+  const char *text[] = {"", "a", "ab", "ba", "baa", "baab", 0};
+  for (std::size_t i = 0; text[i] != NULL; i++) ASSERT_TRUE(SameMatch(r3, *l, text[i]));
+  delete l;
+  // corrupt images: each one passes the magic and the version checks.
+  ASSERT_TRUE(r2.Save(path));
+  std::string image;
+  {
+    std::ifstream ifs(path.c_str(), std::ios::binary);
+    image.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+  }
+  uint64_t regex_offset, dfa_offset, table_offset;
+  memcpy(&regex_offset, &image[16], sizeof(regex_offset));
+  memcpy(&dfa_offset, &image[regex_offset + 56], sizeof(dfa_offset));
+  memcpy(&table_offset, &image[regex_offset + dfa_offset + 16], sizeof(table_offset));
+  const uint64_t huge = 1ULL << 40, wrap = ~0ULL - 7;
+  const struct { uint64_t offset; const void *value; std::size_t size; } corrupt[] = {
+    {16, &wrap, sizeof(wrap)},                                      // the regex beyond the end
+    {regex_offset + 24, &wrap, sizeof(wrap)},                       // pattern offset + length wraps
+    {regex_offset + 48, &huge, sizeof(huge)},                       // keywords beyond the end
+    {regex_offset + dfa_offset + 8, "\x03", 1},                     // a wrong table width
+    {regex_offset + dfa_offset + table_offset, "\xfe\xfe\xfe\xfe", 4}, // transitions to no state
+  };
+  for (std::size_t i = 0; i < sizeof(corrupt) / sizeof(corrupt[0]); i++) {
+    std::string copy(image);
+    copy.replace(corrupt[i].offset, corrupt[i].size, static_cast<const char*>(corrupt[i].value), corrupt[i].size);
+    {
+      std::ofstream ofs(path.c_str(), std::ios::binary);
+      ofs.write(copy.data(), copy.size());
+    }
+    ASSERT_TRUE(Regen::Load(path) == NULL) << i;
+  }
+  remove(path.c_str());
+  ASSERT_TRUE(Regen::Load(path) == NULL);
+  ASSERT_TRUE(Regen::Load(tmp.path) == NULL); // a directory can't be mapped.
+}
+
+TEST(DFATest, FilteredMatch) {
+  const char *regex[] = {"[a-z]+[0-9]xyz", "needle", "(foo|bar)baz", "a[^x]*needle", "ab?cd", "^ab", 0};
+  // mostly filler, a few bytes of the keywords.
+  std::string letters("a1xyz needle foobaz");
+  for (std::size_t i = 0; i < 40; i++) letters += "abcdefxyz0123 -";
+  std::vector<std::string> texts = RandomTexts(5, 100, 200, letters.c_str());
+  for (std::size_t i = 0; i < texts.size(); i++) {
+    std::string &text = texts[i];
+    if (i % 3 == 0) text.insert(rand() % (text.size() + 1), "a1xyz");
+    if (i % 4 == 0) text.insert(rand() % (text.size() + 1), "needle");
+    if (i % 5 == 0) text.insert(rand() % (text.size() + 1), "\nab");
+  }
+  // keywords at the edges of a text (and of its lines).
+  const char *edge[] = {"", "a1xyz", "needle", "--needle", "needle\n", "ab", "\nab", "ab\n", "foobaz", 0};
+  texts.insert(texts.end(), edge, edge + sizeof(edge) / sizeof(edge[0]) - 1);
+  for (std::size_t i = 0; regex[i] != NULL; i++) {
+    Regen::Options opt;
+    opt.partial_match(true);
+    regen::Regex ref(regex[i], opt);
+    ref.Compile(Regen::Options::O0);
+    opt.filtered_match(true);
+    regen::Regex r(regex[i], opt);
+    r.Compile(Regen::Options::O3);
+    ASSERT_TRUE(SameMatches(ref, r, texts)) << regex[i];
+  }
+}
+
+TEST(DFATest, SkipLoop) {
+  const char *regex[] = {"a[^b]*b", "x[^\\n]*y", "\"[^\"]*\"", "q[^z]*z[^q]*q", 0};
+  // long runs of filler bytes between the exits of the loops.
+  std::string letters("abqxyz\"\n");
+  for (std::size_t i = 0; i < 6; i++) letters += "efghijklmn";
+  // the exit byte at the end of a text, or just after the loop starts.
+  const char *edge[] = {"ab", "a", "ef\"\"", "\"efgh", "qz", "qzq", "qefzefq", "xy\n", 0};
+  std::vector<std::string> texts = RandomTexts(12, 100, 200, letters.c_str(), edge);
+  for (std::size_t i = 0; regex[i] != NULL; i++) {
+    for (std::size_t n = 0; n < 3; n++) { // partial, shortest and reverse.
+      Regen::Options opt;
+      opt.partial_match(true);
+      opt.shortest_match(n == 1);
+      opt.reverse_match(n == 2);
+      regen::Regex ref(regex[i], opt);
+      ref.Compile(Regen::Options::O0);
+      regen::Regex r(regex[i], opt);
+      r.Compile(Regen::Options::O2);
+      ASSERT_TRUE(SameMatches(ref, r, texts)) << regex[i];
+    }
+  }
+}
+
+TEST(DFATest, CGenerate) {
+  if (system("cc --version >/dev/null 2>&1") != 0) {
+    std::cout << "cc is not available, CGenerate is skipped." << std::endl;
+    return;
+  }
+  const char *regex[] = {"[^c]*c", "ab+c", "(a|b)*a(a|b){2}", "x[^\\n]*y$", "^(ab|cd)*$", 0};
+  // the texts (a length line, then the bytes) are matched in one run.
+  static const char driver[] =
+      "#include <stdio.h>\n"
+      "#include \"match.c\"\n"
+      "int main(int argc, char *argv[])\n"
+      "{\n"
+      "  static unsigned char buf[4096];\n"
+      "  FILE *in = fopen(argv[1], \"rb\"), *out = fopen(argv[2], \"w\");\n"
+      "  unsigned long n;\n"
+      "  while (fscanf(in, \"%lu\", &n) == 1 && fgetc(in) == '\\n' && fread(buf, 1, n, in) == n) {\n"
+      "    const unsigned char *m = NULL;\n"
+      "    int accept = match(buf, buf + n, &m);\n"
+      "    fprintf(out, \"%d %ld\\n\", accept, m == NULL ? -1L : (long)(m - buf));\n"
+      "  }\n"
+      "  return fclose(out) != 0;\n"
+      "}\n";
+  TempDir tmp;
+  ASSERT_FALSE(tmp.path.empty());
+  const std::string bin = tmp.path + "/match", input = tmp.path + "/input", output = tmp.path + "/output";
+  FILE *fp = fopen((tmp.path + "/main.c").c_str(), "w");
+  ASSERT_TRUE(fp != NULL);
+  fputs(driver, fp);
+  fclose(fp);
+  std::vector<std::string> texts = RandomTexts(23, 30, 40, "abcdxy\n");
+  fp = fopen(input.c_str(), "wb");
+  ASSERT_TRUE(fp != NULL);
+  for (std::size_t j = 0; j < texts.size(); j++) {
+    fprintf(fp, "%lu\n", (unsigned long)texts[j].size());
+    fwrite(texts[j].data(), 1, texts[j].size(), fp);
+  }
+  fclose(fp);
+  for (std::size_t i = 0; regex[i] != NULL; i++) {
+    for (std::size_t n = 0; n < 3; n++) { // full, longest and shortest.
+      Regen::Options opt(Regen::Options::OneLine); // as recon -c does.
+      opt.partial_match(n != 0);
+      opt.shortest_match(n == 2);
+      regen::Regex r(regex[i], opt);
+      r.Compile(Regen::Options::O0);
+      fp = fopen((tmp.path + "/match.c").c_str(), "w");
+      ASSERT_TRUE(fp != NULL);
+      regen::Generator::CGenerate(r.dfa(), fp);
+      fclose(fp);
+      // the generated code must build without warnings (e.g. unused labels).
+      ASSERT_EQ(0, system(("cc -Wall -Werror -o " + bin + " " + tmp.path + "/main.c").c_str())) << regex[i];
+      ASSERT_EQ(0, system((bin + " " + input + " " + output).c_str())) << regex[i];
+      fp = fopen(output.c_str(), "r");
+      ASSERT_TRUE(fp != NULL);
+      for (std::size_t j = 0; j < texts.size(); j++) {
+        int accept = -1;
+        long end = -1;
+        ASSERT_EQ(2, fscanf(fp, "%d %ld", &accept, &end)) << regex[i];
+        Regen::StringPiece result;
+        ASSERT_EQ(r.Match(texts[j], &result), accept == 1) << regex[i] << " " << texts[j];
+        ASSERT_EQ(result.end() == NULL ? -1L : (long)(result.end() - texts[j].data()), end) << regex[i] << " " << texts[j];
+      }
+      fclose(fp);
+    }
+  }
+}
+
+#ifdef REGEN_ENABLE_JIT
+TEST(DFATest, JITCache) {
+  const std::size_t TESTNUM = sizeof(test) / sizeof(testcase);
+  TempDir tmp;
+  ASSERT_FALSE(tmp.path.empty());
+  Regen::Options opt;
+  opt.jit_cache(tmp.path);
+  for (std::size_t n = 0; n < 2; n++) { // fill, then load the cache.
+    for (std::size_t i = 0; i < TESTNUM; i++) {
+      Regen r(test[i].regex, opt);
+      r.Compile(Regen::Options::O3);
+      ASSERT_EQ(r.Match(test[i].text), test[i].result);
+    }
+  }
+  opt.filtered_match(true);
+  regen::Regex r1("[a-z]+[0-9]xyz", opt), r2("[a-z]+[0-9]xyz", opt);
+  r1.Compile(Regen::Options::O2);
+  r2.Compile(Regen::Options::O2);
+  const char *text[] = {"a1xyz", "--a1xyz--", "--a1xy--", "xyz", 0};
+  for (std::size_t i = 0; text[i] != NULL; i++) {
+    Regen::StringPiece result1, result2;
+    ASSERT_EQ(r1.Match(text[i], &result1), r2.Match(text[i], &result2));
+    ASSERT_EQ(result1.end() - text[i], result2.end() - text[i]);
+  }
+}
+#endif
+
+#ifdef REGEN_ENABLE_PARALLEL
+static void LazyMatchTask(const regen::Regex *r, const std::vector<std::string> *texts,
+                          const std::vector<int> *expect, int *errors)
+{
+  for (std::size_t n = 0; n < 5; n++) {
+    for (std::size_t i = 0; i < texts->size(); i++) {
+      Regen::StringPiece result;
+      bool match = r->Match((*texts)[i], &result);
+      if (match != ((*expect)[i] >= 0) || (match && result.end()-(*texts)[i].data() != (*expect)[i])) (*errors)++;
+    }
+  }
+}
+
+TEST(DFATest, SharedLazyCache) {
+  Regen::Options opt;
+  opt.partial_match(true);
+  opt.cache_size(1 << 14);
+  regen::Regex r("(a|b)*a(a|b){6}c", opt);
+  opt.cache_size(1 << 24);
+  regen::Regex ref("(a|b)*a(a|b){6}c", opt);
+  std::vector<std::string> texts;
+  std::vector<int> expect;
+  srand(1);
+  for (std::size_t i = 0; i < 200; i++) {
+    std::string text;
+    for (std::size_t j = rand() % 200; j > 0; j--) text += "abbc"[rand() % 4];
+    Regen::StringPiece result;
+    texts.push_back(text);
+    expect.push_back(ref.Match(texts.back(), &result) ? result.end()-texts.back().data() : -1);
+  }
+  const std::size_t THREADNUM = 8;
+  int errors[THREADNUM] = {0};
+  boost::thread_group threads;
+  for (std::size_t i = 0; i < THREADNUM; i++) {
+    threads.create_thread(boost::bind(LazyMatchTask, &r, &texts, &expect, &errors[i]));
+  }
+  threads.join_all();
+  for (std::size_t i = 0; i < THREADNUM; i++) ASSERT_EQ(errors[i], 0);
+}
+
+/* the SFAs of a DFA (eager, speculative and lazy mappings) match the
+   texts as the DFA does. */
+static ::testing::AssertionResult SameSFAMatches(const regen::Regex &r, Regen::Options::CompileFlag olevel,
+                                                 const std::vector<std::string> &texts, std::size_t threads = 4)
+{
+  regen::SFA sfa(r.dfa(), threads), speculative(r.dfa(), threads, regen::SFA::Speculative);
+  regen::SFA lazy(r.dfa(), threads, regen::SFA::Lazy);
+  sfa.Compile(olevel);
+  speculative.Compile(olevel);
+  ::testing::AssertionResult eager = SameMatches(r, sfa, texts);
+  if (!eager) return eager << " (eager)";
+  ::testing::AssertionResult speculative_ = SameMatches(r, speculative, texts);
+  if (!speculative_) return speculative_ << " (speculative)";
+  ::testing::AssertionResult lazy_ = SameMatches(r, lazy, texts);
+  if (!lazy_) return lazy_ << " (lazy)";
+  return ::testing::AssertionSuccess();
+}
+
+TEST(DFATest, ParallelMatch) {
+  const char *regex[] = {"(a|b)*a(a|b){3}", "(ab|b)*a?", "[ab]*bbb[ab]*", 0};
+  // short strings are matched by the caller, long ones by the workers.
+  std::vector<std::string> texts = RandomTexts(29, 24, 100, "ab"), longs = RandomTexts(30, 8, 300000, "ab");
+  for (std::size_t i = 0; i < longs.size(); i++) texts[i * 3].swap(longs[i]);
+  // a match across the first boundary of the chunks, and pairs split
+  // by all of them (odd boundaries).
+  std::string boundary(4 * regen::SFA::min_task_size, 'a'), pairs("b");
+  boundary.replace(regen::SFA::min_task_size - 1, 3, "bbb");
+  for (std::size_t i = 0; i < 2 * regen::SFA::min_task_size + 1; i++) pairs += "ab";
+  texts.push_back(boundary);
+  texts.push_back(pairs);
+  for (std::size_t i = 0; regex[i] != NULL; i++) {
+    regen::Regex r(regex[i]);
+    r.Compile(Regen::Options::O0);
+    ASSERT_TRUE(SameSFAMatches(r, Regen::Options::O0, texts)) << regex[i];
+    ASSERT_TRUE(SameSFAMatches(r, Regen::Options::O1, texts)) << regex[i];
+  }
+  // a small cache of lazy mappings is flushed by the tasks.
+  Regen::Options opt;
+  opt.cache_size(1 << 10);
+  regen::Regex small(regex[0], opt);
+  small.Compile(Regen::Options::O0);
+  regen::SFA lazy(small.dfa(), 4, regen::SFA::Lazy);
+  ASSERT_TRUE(SameMatches(small, lazy, texts));
+  ASSERT_GT(lazy.cache_flushes(), 0u);
+  // mappings of NFA states: (a|b)*a(a|b){3}.
+  regen::NFA nfa;
+  for (std::size_t i = 0; i < 5; i++) {
+    regen::NFA::State &state = nfa.get_new_state();
+    if (i == 0) {
+      state['a'].insert(0);
+      state['a'].insert(1);
+      state['b'].insert(0);
+    } else if (i < 4) {
+      state['a'].insert(i+1);
+      state['b'].insert(i+1);
+    }
+    state.accept = i == 4;
+  }
+  nfa.start_states().insert(0);
+  regen::Regex r(regex[0]);
+  r.Compile(Regen::Options::O0);
+  regen::SFA sfa(nfa, 4);
+  sfa.Compile(Regen::Options::O1);
+  ASSERT_TRUE(SameMatches(r, sfa, texts));
+  // rows of several words: a{200}.
+  regen::NFA chain;
+  for (std::size_t i = 0; i <= 200; i++) {
+    regen::NFA::State &state = chain.get_new_state();
+    if (i < 200) state['a'].insert(i+1);
+    state.accept = i == 200;
+  }
+  chain.start_states().insert(0);
+  regen::Regex a("a{200}");
+  a.Compile(Regen::Options::O0);
+  regen::SFA wide(chain, 4);
+  for (std::size_t n = 190; n < 210; n++) {
+    std::string text(n, 'a');
+    ASSERT_TRUE(SameMatch(a, wide, text));
+    text[n / 2] = 'b';
+    ASSERT_TRUE(SameMatch(a, wide, text));
+  }
+}
+
+TEST(DFATest, ParallelMatchResult) {
+  const char *regex[] = {"(a|b)*a(a|b){3}", "ab+a", "[ab]*bbb[ab]*", 0};
+  std::vector<std::string> texts = RandomTexts(31, 16, 100, "abbac"), longs = RandomTexts(32, 8, 300000, "abba");
+  for (std::size_t i = 0; i < longs.size(); i++) texts[i * 2].swap(longs[i]);
+  // some strings are rejected (by 'c') in the middle of a chunk.
+  for (std::size_t i = 0; i < texts.size(); i += 4) {
+    if (texts[i].size() > regen::SFA::min_task_size * 2) texts[i][regen::SFA::min_task_size * 3 / 2] = 'c';
+  }
+  // a match which ends at the first boundary of the chunks.
+  std::string boundary(4 * regen::SFA::min_task_size, 'c');
+  boundary.replace(regen::SFA::min_task_size - 4, 4, "abba");
+  texts.push_back(boundary);
+  for (std::size_t i = 0; regex[i] != NULL; i++) {
+    for (std::size_t n = 0; n < 3; n++) {
+      Regen::Options opt;
+      opt.partial_match(n > 0);
+      opt.shortest_match(n == 2);
+      regen::Regex r(regex[i], opt);
+      r.Compile(Regen::Options::O0);
+      ASSERT_TRUE(SameSFAMatches(r, Regen::Options::O0, texts)) << regex[i];
+      // an odd chunk sits out a level of the joins.
+      ASSERT_TRUE(SameSFAMatches(r, Regen::Options::O0, texts, 7)) << regex[i];
+    }
+  }
+  // mappings of NFA states: ab+a.
+  regen::NFA nfa;
+  for (std::size_t i = 0; i < 4; i++) {
+    regen::NFA::State &state = nfa.get_new_state();
+    if (i == 0) state['a'].insert(1);
+    if (i == 1) state['b'].insert(2);
+    if (i == 2) {
+      state['b'].insert(2);
+      state['a'].insert(3);
+    }
+    state.accept = i == 3;
+  }
+  nfa.start_states().insert(0);
+  regen::Regex r(regex[1]);
+  r.Compile(Regen::Options::O0);
+  regen::SFA sfa(nfa, 4), sfa7(nfa, 7);
+  ASSERT_TRUE(SameMatches(r, sfa, texts));
+  ASSERT_TRUE(SameMatches(r, sfa7, texts));
+}
+
+TEST(DFATest, SFAMinimize) {
+  const char *regex[] = {"(a|b)*a(a|b){3}", "ab+a", "(ab|b)*a?", "[ab]*bbb[ab]*", 0};
+  // texts of a single chunk, decided by one (merged) mapping.
+  const char *edge[] = {"", "a", "c", "abba", 0};
+  std::vector<std::string> texts = RandomTexts(37, 16, 100, "abbac", edge), longs = RandomTexts(38, 8, 300000, "abba");
+  for (std::size_t i = 0; i < longs.size(); i++) texts[i * 2].swap(longs[i]);
+  for (std::size_t i = 0; regex[i] != NULL; i++) {
+    Regen::Options opt;
+    opt.partial_match(i % 2 == 1);
+    regen::Regex r(regex[i], opt);
+    r.Compile(Regen::Options::O0);
+    for (std::size_t olevel = 0; olevel < 2; olevel++) {
+      regen::SFA sfa(r.dfa(), 4), minimum(r.dfa(), 4);
+      ASSERT_TRUE(minimum.Minimize());
+      ASSERT_LE(minimum.size(), sfa.size());
+      minimum.Compile(olevel ? Regen::Options::O1 : Regen::Options::O0);
+      ASSERT_TRUE(SameMatches(sfa, minimum, texts)) << regex[i];
+    }
+  }
+  // the SFA of a DFA with redundant states.
+  regen::Regex r("(a|b)*a(a|b){3}");
+  r.Compile(Regen::Options::O0);
+  regen::Regex m("(a|b)*a(a|b){3}");
+  m.Compile(Regen::Options::O0);
+  m.MinimizeDFA();
+  regen::SFA sfa(r.dfa(), 4), minimum(m.dfa(), 4);
+  ASSERT_TRUE(sfa.Minimize());
+  ASSERT_TRUE(minimum.Minimize());
+  ASSERT_EQ(minimum.size(), sfa.size());
+}
+#endif
@@ -27,12 +27,18 @@ typedef unsigned char uint8_t;
 #include <deque>
 #include <map>
 
+#ifdef REGEN_ENABLE_PARALLEL
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#endif
+
 #include <sys/stat.h>
 #ifdef _MSC_VER
 #include <windows.h>
 #include "win/getopt.h"
 #else
 #include <sys/mman.h>
+#include <sys/time.h>
 #include <fcntl.h>
 #include <unistd.h>
 #endif
@@ -64,7 +70,9 @@ namespace Util {
 
 #ifdef _WIN32
 struct mmap_t{
-  mmap_t(const char* path, bool write_mode=false, int flags=0)
+  /* exit_on_error: a file which can't be mapped exits the process,
+     otherwise the map is false (see Open). */
+  mmap_t(const char* path, bool write_mode=false, int flags=0, bool exit_on_error=true)
     : size(0)
     , ptr(0)
     , h1(0)
@@ -75,44 +83,63 @@ struct mmap_t{
     }
     h1 = ::CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
     if (h1 == INVALID_HANDLE_VALUE) {
-      fprintf(stderr, "ERR:CreateFile %s\n", path);
-      exit(1);
+      h1 = 0;
+      Fail("CreateFile", path, exit_on_error);
+      return;
     }
     LARGE_INTEGER li;
     if (::GetFileSizeEx(h1, &li) == 0) {
-      fprintf(stderr, "ERR:GetFileSizeEx %s\n", path);
-      exit(1);
+      Fail("GetFileSizeEx", path, exit_on_error);
+      return;
     }
     size = li.QuadPart;
     h2 = ::CreateFileMapping(h1, NULL, PAGE_READONLY, 0, 0, NULL);
     if (h2 == NULL) {
-      fprintf(stderr, "ERR:CreateFileMapping %s\n", path);
-      exit(1);
+      Fail("CreateFileMapping", path, exit_on_error);
+      return;
     }
-    ptr = MapViewOfFile(h2, FILE_MAP_READ, 0, 0, 0);
+    ptr = (char *)MapViewOfFile(h2, FILE_MAP_READ, 0, 0, 0);
     if (ptr == NULL) {
-      fprintf(stderr, "ERR:MapViewOfFile\n", path);
-      exit(1);
+      Fail("MapViewOfFile", path, exit_on_error);
+      return;
     }
   }
 
   ~mmap_t() {
-    if (!ptr) return;
-    UnmapViewOfFile(ptr);
-    CloseHandle(h2);
-    CloseHandle(h1);
+    if (ptr != NULL && ptr != (char *)-1) UnmapViewOfFile(ptr);
+    if (h2) CloseHandle(h2);
+    if (h1) CloseHandle(h1);
   }
 
   operator bool () const
   { return ptr != (void *)-1; }
 
+  // NULL if the file can't be mapped.
+  static mmap_t *Open(const char *path) {
+    mmap_t *m = new mmap_t(path, false, 0, false);
+    if (*m) return m;
+    delete m;
+    return NULL;
+  }
+
   uint64_t size;
   char *ptr;
   HANDLE h1, h2;
+private:
+  void Fail(const char *what, const char *path, bool exit_on_error) {
+    if (exit_on_error) {
+      fprintf(stderr, "ERR:%s %s\n", what, path);
+      exit(1);
+    }
+    ptr = (char *)-1;
+  }
 };
 #else
 struct mmap_t{
-  mmap_t(const char* path, bool write_mode=false, int flags=MAP_FILE|MAP_PRIVATE){
+  /* exit_on_error: a file which can't be mapped exits the process,
+     otherwise the map is false (see Open). */
+  mmap_t(const char* path, bool write_mode=false, int flags=MAP_FILE|MAP_PRIVATE, bool exit_on_error=true)
+      : size(0), ptr((char *)MAP_FAILED) {
     int OPEN_MODE=O_RDONLY;
     int PROT = PROT_READ;
     if(write_mode) {
@@ -122,25 +149,88 @@ struct mmap_t{
 
     int f = open(path, OPEN_MODE);
     struct stat statbuf;
-    fstat(f, &statbuf);
-    ptr = (char *)mmap(0, statbuf.st_size, PROT, flags, f, 0);
-    if (ptr == MAP_FAILED) exitmsg("can't mmap %s\n", path);
-    size=statbuf.st_size;
-    close(f);
+    if (f >= 0 && fstat(f, &statbuf) == 0) {
+      ptr = (char *)mmap(0, statbuf.st_size, PROT, flags, f, 0);
+      size=statbuf.st_size;
+    }
+    if (f >= 0) close(f);
+    if (ptr == MAP_FAILED) {
+      size = 0;
+      if (exit_on_error) exitmsg("can't mmap %s\n", path);
+    }
   }
 
   ~mmap_t() {
-    munmap(ptr, size);
+    if (ptr != MAP_FAILED) munmap(ptr, size);
   }
 
   operator bool () const
   { return ptr != (void *)-1; }
 
+  // NULL if the file can't be mapped.
+  static mmap_t *Open(const char *path) {
+    mmap_t *m = new mmap_t(path, false, MAP_FILE|MAP_PRIVATE, false);
+    if (*m) return m;
+    delete m;
+    return NULL;
+  }
+
   size_t size;
   char *ptr;
 };
 #endif
 
+/* locks of the shared (on-the-fly) DFA, no-ops in single thread builds.
+   a copied lock is a fresh (unlocked) one. */
+#ifdef REGEN_ENABLE_PARALLEL
+struct mutex_t: boost::mutex {
+  mutex_t() {}
+  mutex_t(const mutex_t &): boost::mutex() {}
+  mutex_t &operator=(const mutex_t &) { return *this; }
+};
+struct shared_mutex_t: boost::shared_mutex {
+  shared_mutex_t() {}
+  shared_mutex_t(const shared_mutex_t &): boost::shared_mutex() {}
+  shared_mutex_t &operator=(const shared_mutex_t &) { return *this; }
+};
+#else
+struct mutex_t {
+  void lock() {}
+  void unlock() {}
+};
+struct shared_mutex_t {
+  void lock() {}
+  void unlock() {}
+  void lock_shared() {}
+  void unlock_shared() {}
+  void unlock_and_lock_shared() {}
+};
+#endif
+
+#ifdef _MSC_VER
+template<class T> inline T load_acquire(const T *p)
+{ T v = *(volatile const T *)p; _ReadWriteBarrier(); return v; }
+template<class T> inline void store_release(T *p, T v)
+{ _ReadWriteBarrier(); *(volatile T *)p = v; }
+#else
+template<class T> inline T load_acquire(const T *p)
+{ return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+template<class T> inline void store_release(T *p, T v)
+{ __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+#endif
+
+/* wall clock in milliseconds. */
+inline uint64_t msec()
+{
+#ifdef _MSC_VER
+  return GetTickCount64();
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
 } // namespace Util
 
 } // namespace regen